@@ -0,0 +1,324 @@
+// compact_packer.h: a value_packer with variable length integers, for small values on the wire.
+//
+// format, not compatible with binary_packer:
+//   uint16/32/64      LEB128 varint: 7 bits a byte, low group first, high bit set on all but
+//                     the last byte; values below 128 take one byte
+//   int16/32/64       zigzag mapped ((n << 1) ^ (n >> 63)), then varint, so that small
+//                     negative numbers are short too
+//   int8/uint8        the byte itself
+//   float/double      4/8 bytes little endian
+//   string/binary     varint length, then the bytes (strings in UTF-8, as binary_packer)
+//   raw               the bytes
+// varints of up to 8 bytes (values below 2^56) are encoded and decoded with a few shifts and
+// masks on one 64 bit word instead of a loop over the bytes.
+
+#ifndef IMSUX_COMPACT_PACKER_H_INCLUDED__
+#define IMSUX_COMPACT_PACKER_H_INCLUDED__
+
+#include "packer.h"
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace imsux {
+
+class compact_packer : public value_packer, protected basic_packer<little_endian_order>
+{
+	typedef basic_packer<little_endian_order> base;
+
+public:
+	enum { max_varint = 10 };
+
+	compact_packer(int32_t init_buffer = 0, const char * charset = "", packer_allocator * allocator = NULL)
+		: base(init_buffer, charset, allocator)
+	{
+	}
+
+	virtual ~compact_packer()
+	{
+	}
+
+public:
+	// access interfaces
+	virtual void * buffer() { return base::buffer(); }
+	virtual int32_t length() const { return base::length(); }
+	virtual void bind(byte * buffer, int32_t buffer_len) { base::bind(buffer, buffer_len); }
+	virtual void reset() { base::reset(); }
+
+	// push interfaces
+	virtual void push_int8 (int8_t  v) { base::push_int8(v); }
+	virtual void push_int16(int16_t v) { push_varint(zigzag(v)); }
+	virtual void push_int32(int32_t v) { push_varint(zigzag(v)); }
+	virtual void push_int64(int64_t v) { push_varint(zigzag(v)); }
+	virtual void push_float(float   v) { base::push_float(v); }
+	virtual void push_double(double v) { base::push_double(v); }
+
+	virtual void push_uint8 (uint8_t  v) { base::push_uint8(v); }
+	virtual void push_uint16(uint16_t v) { push_varint(v); }
+	virtual void push_uint32(uint32_t v) { push_varint(v); }
+	virtual void push_uint64(uint64_t v) { push_varint(v); }
+
+	using value_packer::push_string;
+	virtual void push_string(const char * v, int32_t n = -1)
+	{
+		if (n < -1) throw std::invalid_argument("invalid string length.");
+		if (!v) throw std::invalid_argument("null string specified.");
+
+		int32_t len = (n == -1) ? (int)strlen(v) : n;
+		if (m_utf8)
+		{
+			push_binary(v, len);
+			return;
+		}
+
+		std::string utf8 = m_conv.to_utf8(v, len);
+		push_binary(utf8.c_str(), (int)utf8.length());
+	}
+
+	using value_packer::push_binary;
+	virtual void push_binary(const void * v, int32_t n)
+	{
+		if (!v) throw std::invalid_argument("invalid address.");
+		if (n < 0) throw std::invalid_argument("invalid buffer length.");
+
+		push_varint((uint32_t)n);
+		base::push_raw(v, n);
+	}
+
+	using value_packer::push_raw;
+	virtual void push_raw(const void * v, int32_t n) { base::push_raw(v, n); }
+
+	void push_varint(uint64_t v)
+	{
+		ensure_buffer_enough(max_varint);
+		m_buffer_occupied += encode_varint(m_buffer + m_buffer_occupied, v);
+	}
+
+	// pop interfaces
+	virtual void pop_reset(int32_t pos = 0) { base::pop_reset(pos); }
+
+	virtual int8_t  pop_int8 () { return base::pop_int8(); }
+	virtual int16_t pop_int16() { return narrow<int16_t>(unzigzag(pop_varint())); }
+	virtual int32_t pop_int32() { return narrow<int32_t>(unzigzag(pop_varint())); }
+	virtual int64_t pop_int64() { return unzigzag(pop_varint()); }
+	virtual float   pop_float() { return base::pop_float(); }
+	virtual double  pop_double(){ return base::pop_double(); }
+
+	virtual uint8_t  pop_uint8 () { return base::pop_uint8(); }
+	virtual uint16_t pop_uint16() { return narrow<uint16_t>(pop_varint()); }
+	virtual uint32_t pop_uint32() { return narrow<uint32_t>(pop_varint()); }
+	virtual uint64_t pop_uint64() { return pop_varint(); }
+
+	virtual std::string pop_string()
+	{
+		blob_view utf8 = pop_binary_view();
+		if (m_utf8) return std::string((const char *)utf8.buffer(), utf8.length());
+
+		return m_conv.from_utf8((const char *)utf8.buffer(), utf8.length());
+	}
+
+	// as value_packer: v == NULL queries the length without popping
+	virtual int32_t pop_string(char * v, int32_t n)
+	{
+		if (v == NULL) return peek_length();
+		if (n <= 0) throw std::invalid_argument("string buffer length not valid.");
+
+		std::string s = pop_string();
+		int32_t cp = (int32_t)s.length() > n - 1 ? n - 1 : (int32_t)s.length();
+
+		memcpy(v, s.data(), cp);
+		v[cp] = '\0';
+
+		return (int)strlen(v);
+	}
+
+	virtual blob pop_binary()
+	{
+		blob_view b = pop_binary_view();
+
+		return blob((byte *)b.buffer(), b.length());
+	}
+
+	virtual int32_t pop_binary(void * v, int32_t n)
+	{
+		if (v == NULL) return peek_length();
+		if (n < 0) throw std::invalid_argument("invalid buffer length.");
+
+		blob_view b = pop_binary_view();
+		int32_t cp = b.length() > n ? n : b.length();
+
+		memcpy(v, b.buffer(), cp);
+		return cp;
+	}
+
+	virtual int32_t pop_raw(void * v, int32_t n) { return base::pop_raw(v, n); }
+	virtual blob pop_raw(int32_t n) { return base::pop_raw(n); }
+
+	// zero-copy pops, as binary_packer
+#ifdef IMSUX_PACKER_STRING_VIEW
+	std::string_view pop_string_view()
+	{
+		blob_view b = pop_binary_view();
+
+		return std::string_view((const char *)b.buffer(), b.length());
+	}
+#endif
+
+	blob_view pop_binary_view()
+	{
+		int32_t popped = m_popped;
+		uint64_t len = pop_varint();
+
+		if (len > (uint64_t)(m_buffer_occupied - m_popped))
+		{
+			m_popped = popped;
+			throw std::out_of_range("not enough content.");
+		}
+
+		m_popped += (int32_t)len;
+		return blob_view(m_buffer + m_popped - len, (int32_t)len);
+	}
+
+	using base::pop_raw_view;
+	using base::pop_position;
+
+	uint64_t pop_varint()
+	{
+		uint64_t v;
+		m_popped += decode_varint(m_buffer + m_popped, m_buffer + m_buffer_occupied, v);
+		return v;
+	}
+
+// assistant static functions
+public:
+	static uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63); }
+	static int64_t unzigzag(uint64_t v) { return (int64_t)(v >> 1) ^ -(int64_t)(v & 1); }
+
+	// writes v at p, which must have max_varint bytes of room; returns the bytes used
+	static int encode_varint(byte * p, uint64_t v)
+	{
+		if (v < 0x80)
+		{
+			*p = (byte)v;
+			return 1;
+		}
+
+		// bytes needed: one for every started 7 bits
+		int bits = 64 - count_leading_zeros(v);
+		int n = (bits + 6) / 7;
+		if (n > 8)
+		{
+			int i = 0;
+			for (; v >= 0x80; v >>= 7) p[i++] = (byte)(v | 0x80);
+			p[i++] = (byte)v;
+			return i;
+		}
+
+		// the 7 bit groups in the bytes of one word, continuation bits on all but the last
+		uint64_t x = (v & 0x7f)
+			| ((v << 1) & 0x7f00ull)
+			| ((v << 2) & 0x7f0000ull)
+			| ((v << 3) & 0x7f000000ull)
+			| ((v << 4) & 0x7f00000000ull)
+			| ((v << 5) & 0x7f0000000000ull)
+			| ((v << 6) & 0x7f000000000000ull)
+			| ((v << 7) & 0x7f00000000000000ull);
+		x |= 0x8080808080808080ull & ((1ull << (8 * (n - 1))) - 1);
+
+		x = little_endian_order::convert(x);
+		memcpy(p, &x, 8);
+		return n;
+	}
+
+	// reads a varint from [p, end) into v; returns the bytes used
+	static int decode_varint(const byte * p, const byte * end, uint64_t & v)
+	{
+		if (p < end && *p < 0x80)
+		{
+			v = *p;
+			return 1;
+		}
+
+		if (end - p >= 8)
+		{
+			uint64_t x;
+			memcpy(&x, p, 8);
+			x = little_endian_order::convert(x);
+
+			// the first byte without a continuation bit ends the varint
+			uint64_t stops = ~x & 0x8080808080808080ull;
+			if (stops)
+			{
+				int n = count_trailing_zeros(stops) / 8 + 1;
+				if (n < 8) x &= (1ull << (8 * n)) - 1;
+
+				v = (x & 0x7f)
+					| ((x >> 1) & (0x7full << 7))
+					| ((x >> 2) & (0x7full << 14))
+					| ((x >> 3) & (0x7full << 21))
+					| ((x >> 4) & (0x7full << 28))
+					| ((x >> 5) & (0x7full << 35))
+					| ((x >> 6) & (0x7full << 42))
+					| ((x >> 7) & (0x7full << 49));
+				return n;
+			}
+		}
+
+		// near the end, or 9 and 10 byte values
+		v = 0;
+		for (int i = 0; i < max_varint; ++i)
+		{
+			if (p + i >= end) throw std::out_of_range("no more content.");
+			if (i == max_varint - 1 && p[i] > 1) break;
+
+			v |= (uint64_t)(p[i] & 0x7f) << (7 * i);
+			if (p[i] < 0x80) return i + 1;
+		}
+		throw std::out_of_range("invalid varint.");
+	}
+
+protected:
+	static int count_leading_zeros(uint64_t v)
+	{
+#if defined(_MSC_VER)
+		unsigned long i;
+		_BitScanReverse64(&i, v);
+		return 63 - (int)i;
+#else
+		return __builtin_clzll(v);
+#endif
+	}
+
+	static int count_trailing_zeros(uint64_t v)
+	{
+#if defined(_MSC_VER)
+		unsigned long i;
+		_BitScanForward64(&i, v);
+		return (int)i;
+#else
+		return __builtin_ctzll(v);
+#endif
+	}
+
+	// a decoded value the pop type cannot hold is a broken message
+	template <class T, class V>
+	static T narrow(V v)
+	{
+		if ((V)(T)v != v) throw std::out_of_range("value out of range.");
+		return (T)v;
+	}
+
+	// length of the string or binary at the pop position, not popped
+	int32_t peek_length()
+	{
+		int32_t popped = m_popped;
+		uint64_t len = pop_varint();
+		m_popped = popped;
+
+		return narrow<int32_t>(len);
+	}
+};
+
+} // namespace imsux
+
+#endif//IMSUX_COMPACT_PACKER_H_INCLUDED__
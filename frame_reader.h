@@ -0,0 +1,164 @@
+// frame_reader.h: length prefixed packer frames over a stream, decoded as the bytes arrive.
+//
+// a frame is a big endian int32 length, as push_int32() writes it, and that many bytes,
+// usually a packer's buffer. write_frame() sends one; a frame_reader collects reads from a
+// socket or pipe in its receive buffer and hands out every complete frame as a view into that
+// buffer, whatever the reads split it into. only the unfinished frame at the end of the buffer
+// is ever moved, to make room for the next read.
+
+#ifndef IMSUX_FRAME_READER_H_INCLUDED__
+#define IMSUX_FRAME_READER_H_INCLUDED__
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "packer.h"
+
+namespace imsux {
+
+class frame_reader
+{
+public:
+	enum { header_size = 4 };
+
+	// frames longer than max_frame are taken for a broken stream
+	frame_reader(int32_t buffer_size = 64 << 10, int32_t max_frame = 64 << 20)
+		: m_buffer(buffer_size < header_size ? header_size : buffer_size)
+		, m_start(0)
+		, m_end(0)
+		, m_max_frame(max_frame)
+	{
+		if (max_frame < 0) throw std::invalid_argument("invalid frame length.");
+	}
+
+	// one frame of len bytes; false with errno set on failure
+	static bool write_frame(int fd, const void * data, int32_t len)
+	{
+		if (len < 0) throw std::invalid_argument("invalid buffer length.");
+
+		int32_t header = big_endian_order::convert(len);
+		iovec iov[2] = { { &header, header_size }, { (void *)data, (size_t)len } };
+
+		int first = 0;
+		while (first < 2)
+		{
+			ssize_t n = ::writev(fd, iov + first, 2 - first);
+			if (n < 0)
+			{
+				if (errno == EINTR) continue;
+				return false;
+			}
+
+			for (; first < 2 && (size_t)n >= iov[first].iov_len; ++first) n -= iov[first].iov_len;
+			if (first < 2)
+			{
+				iov[first].iov_base = (char *)iov[first].iov_base + n;
+				iov[first].iov_len -= n;
+			}
+		}
+		return true;
+	}
+
+	// one read() of what fd has: the byte count, 0 at end of stream, -1 with errno set on
+	// failure (EAGAIN for a non-blocking fd with nothing to read). views from next() are
+	// invalid afterwards.
+	ssize_t read_from(int fd)
+	{
+		make_room();
+
+		ssize_t n;
+		while ((n = ::read(fd, &m_buffer[m_end], m_buffer.size() - m_end)) < 0 && errno == EINTR);
+		if (n > 0) m_end += n;
+
+		return n;
+	}
+
+	// bytes that came some other way; views from next() are invalid afterwards
+	void feed(const void * data, size_t len)
+	{
+		const byte * p = (const byte *)data;
+		while (len)
+		{
+			make_room();
+
+			size_t n = std::min(len, m_buffer.size() - m_end);
+			memcpy(&m_buffer[m_end], p, n);
+			m_end += n;
+			p += n;
+			len -= n;
+		}
+	}
+
+	// the next complete frame, without its length; false when it has not fully arrived yet.
+	// the view is valid until the next read_from() or feed().
+	bool next(blob_view & frame)
+	{
+		int32_t len = pending_length();
+		if (len < 0 || m_end - m_start < header_size + (size_t)len) return false;
+
+		frame = blob_view(&m_buffer[m_start + header_size], len);
+		m_start += header_size + len;
+		return true;
+	}
+
+	// the same, bound to p for popping; p must not be used after the next read_from() or feed()
+	bool next(binary_packer & p)
+	{
+		blob_view frame;
+		if (!next(frame)) return false;
+
+		if (frame.length()) p.bind((byte *)frame.buffer(), frame.length());
+		else p.reset();
+		p.pop_reset();
+
+		return true;
+	}
+
+	// bytes received but not handed out yet, an unfinished frame at the end of a stream
+	size_t buffered() const { return m_end - m_start; }
+
+protected:
+	// length of the frame at m_start, -1 while its header is incomplete
+	int32_t pending_length() const
+	{
+		if (m_end - m_start < header_size) return -1;
+
+		int32_t len;
+		memcpy(&len, &m_buffer[m_start], header_size);
+		len = big_endian_order::convert(len);
+
+		if (len < 0 || len > m_max_frame) throw std::runtime_error("invalid frame length.");
+		return len;
+	}
+
+	// makes sure a read has room and the unfinished frame will fit: moves it to the front
+	// when it would not, and grows the buffer when it cannot hold the frame at all
+	void make_room()
+	{
+		if (m_start == m_end) m_start = m_end = 0;
+
+		int32_t len = pending_length();
+		size_t need = header_size + (len < 0 ? 0 : (size_t)len);
+		if (m_end < m_buffer.size() && m_start + need <= m_buffer.size()) return;
+
+		if (m_start)
+		{
+			memmove(&m_buffer[0], &m_buffer[m_start], m_end - m_start);
+			m_end -= m_start;
+			m_start = 0;
+		}
+
+		if (need > m_buffer.size()) m_buffer.resize(need);
+		if (m_end == m_buffer.size()) m_buffer.resize(m_buffer.size() * 2);
+	}
+
+protected:
+	std::vector<byte> m_buffer;
+	size_t m_start;			// first byte not handed out
+	size_t m_end;			// end of what was received
+	int32_t m_max_frame;
+};
+
+} // namespace imsux
+
+#endif//IMSUX_FRAME_READER_H_INCLUDED__
@@ -16,6 +16,7 @@
 #include "errno_error.hxx"
 #include "comma_sep.hxx"
 #include "stop_watch.hxx"
+#include "mpsc_ring.hxx"
 #ifdef _WINDOWS
 #include "win32_error.hxx"
 #endif//_WINDOWS
@@ -0,0 +1,564 @@
+// log_binary.h: deferred-formatting (binary) log records for logger.h, and their decoder.
+//
+// A binary log file starts with a header, followed by tagged records in host byte order:
+//   'F' id:u32 len:u32 format[len]                                        format definition
+//   'R' id:u32 sec:i64 nsec:i32 severity:u8 flags:u8 len:u32 args[len]    deferred record
+//   'T' sec:i64 nsec:i32 severity:u8 flags:u8 len:u32 text[len]           preformatted record
+// Every format is defined in a file before its first 'R' record, so each rotated file
+// decodes on its own. Arguments are a tag byte plus the raw value:
+//   'i' i32, 'l' i64, 'd' double, 'p' u64 pointer, 's' len:u32 bytes[len].
+
+#ifndef IMSLOG_BINARY_H_INCLUDED__
+#define IMSLOG_BINARY_H_INCLUDED__
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <type_traits>
+
+#define IMSLOG_BINARY_MAGIC     "IMSLOGB\x01"
+#define IMSLOG_BINARY_SUFFIX    ".bin"
+
+#define LOG_FLAG_RAW        0x01
+#define LOG_FLAG_LINEEND    0x02
+#define LOG_FLAG_LINEFEED   0x04
+
+// one per log statement, static storage; id is assigned once on first use. the format is
+// walked then too, for the conversion each argument is encoded by.
+struct log_site
+{
+    enum { max_args = 16 };
+
+    log_site(const char * f) : format(f), id(next_id())
+    {
+        args = parse(f);
+    }
+
+    static int next_id()
+    {
+        static std::atomic<int> id__(0);
+        return id__++;
+    }
+
+    // fills conv and precision, returns the argument count; -1 when there are more than
+    // max_args, such a site is logged as text
+    int parse(const char * f)
+    {
+        int n = 0;
+        for (; (f = strchr(f, '%')) != NULL; ++f)
+        {
+            if (*++f == '%') continue;
+
+            while (*f && strchr("-+ #0'", *f)) ++f;
+            if (*f == '*')
+            {
+                if (!add(n, '*', -1)) return -1;
+                ++f;
+            }
+            while (*f >= '0' && *f <= '9') ++f;
+
+            int prec = -1;
+            if (*f == '.')
+            {
+                if (*++f == '*')
+                {
+                    if (!add(n, '*', -1)) return -1;
+                    prec = -2;
+                    ++f;
+                }
+                else
+                {
+                    prec = 0;
+                    while (*f >= '0' && *f <= '9') prec = prec * 10 + *f++ - '0';
+                }
+            }
+            while (*f && strchr("hlLqjzt", *f)) ++f;
+
+            if (*f == '\0') break;
+            if (!add(n, *f, prec)) return -1;
+        }
+        return n;
+    }
+
+    const char * format;
+    int id;
+    int args;
+    char conv[max_args];        // conversion of each argument, '*' for a width or precision
+    int precision[max_args];    // of each %s: -1 none, -2 the argument before
+                                // ("%.*s"), else the one in the format
+
+private:
+    bool add(int & n, char c, int prec)
+    {
+        if (n == max_args) return false;
+        conv[n] = c;
+        precision[n] = prec;
+        ++n;
+        return true;
+    }
+};
+
+// encodes printf arguments as tagged raw values, by the conversions of site; full is set
+// when buffer runs out.
+struct log_arg_writer
+{
+    log_arg_writer(char * buffer, size_t capacity, const log_site & s)
+        : begin(buffer), p(buffer), end(buffer + capacity), full(false), site(s), index(0), last(-1)
+    {
+    }
+
+    void put(char tag, const void * v, size_t n)
+    {
+        if (full || p + 1 + n > end) { full = true; return; }
+        *p++ = tag;
+        memcpy(p, v, n);
+        p += n;
+    }
+
+    template <class T>
+    typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type arg(T v)
+    {
+        last = (int64_t)v;
+        if (sizeof(T) <= 4)
+        {
+            int32_t i = (int32_t)v;
+            put('i', &i, sizeof(i));
+        }
+        else
+        {
+            int64_t l = (int64_t)v;
+            put('l', &l, sizeof(l));
+        }
+    }
+
+    void arg(double v) { put('d', &v, sizeof(v)); }
+    void arg(float v) { arg((double)v); }
+    void arg(long double v) { arg((double)v); }
+
+    // a string only as far as its precision reaches, it need not end before; %p gets the pointer
+    void arg(const char * s)
+    {
+        int at = index - 1;
+        char c = at < site.args ? site.conv[at] : 's';
+        if (c == 'p')
+        {
+            arg((const void *)s);
+            return;
+        }
+
+        int prec = c == 's' ? site.precision[at] : -1;
+        if (prec == -2) prec = last < 0 || last > INT_MAX ? -1 : (int)last;
+
+        if (s == NULL) s = "(null)";
+        uint32_t n = (uint32_t)(prec < 0 ? strlen(s) : strnlen(s, prec));
+        if (full || p + 1 + sizeof(n) + n > end) { full = true; return; }
+        *p++ = 's';
+        memcpy(p, &n, sizeof(n));
+        memcpy(p + sizeof(n), s, n);
+        p += sizeof(n) + n;
+    }
+
+    template <class T>
+    void arg(const T * v)
+    {
+        uint64_t u = (uint64_t)(uintptr_t)v;
+        put('p', &u, sizeof(u));
+    }
+
+    void args() {}
+
+    template <class T, class... A>
+    void args(const T & v, const A &... rest)
+    {
+        ++index;
+        arg(v);
+        args(rest...);
+    }
+
+    size_t length() const { return p - begin; }
+
+    char * begin;
+    char * p;
+    char * end;
+    bool full;
+    const log_site & site;
+    int index;          // of the argument being written, from 1
+    int64_t last;       // the last integer, a "%.*s" precision
+};
+
+class log_binary
+{
+public:
+    // the append_xxx() functions encode into out, so a record goes to the file in one write
+    static void append_header(std::string & out, int precision)
+    {
+        uint32_t order = 0x01020304;
+        uint8_t prec = (uint8_t)precision;
+        out.append(IMSLOG_BINARY_MAGIC, 8);
+        out.append((const char *)&order, sizeof(order));
+        out.append((const char *)&prec, sizeof(prec));
+    }
+
+    static void append_format(std::string & out, const log_site & site)
+    {
+        uint32_t id = (uint32_t)site.id;
+        uint32_t len = (uint32_t)strlen(site.format);
+        out += 'F';
+        out.append((const char *)&id, sizeof(id));
+        out.append((const char *)&len, sizeof(len));
+        out.append(site.format, len);
+    }
+
+    // 'R' when site is given (body holds encoded arguments), 'T' otherwise (body is text)
+    static void append_record(std::string & out, const log_site * site, const timespec & ts
+        , int severity, int flags, const void * body, size_t len)
+    {
+        char head[32];
+        char * p = head;
+        int64_t sec = (int64_t)ts.tv_sec;
+        int32_t nsec = (int32_t)ts.tv_nsec;
+        uint32_t n = (uint32_t)len;
+
+        *p++ = site ? 'R' : 'T';
+        if (site)
+        {
+            uint32_t id = (uint32_t)site->id;
+            memcpy(p, &id, sizeof(id)); p += sizeof(id);
+        }
+        memcpy(p, &sec, sizeof(sec)); p += sizeof(sec);
+        memcpy(p, &nsec, sizeof(nsec)); p += sizeof(nsec);
+        *p++ = (char)severity;
+        *p++ = (char)flags;
+        memcpy(p, &n, sizeof(n)); p += sizeof(n);
+
+        out.append(head, p - head);
+        out.append((const char *)body, len);
+    }
+
+    // printf-style rendering of a format against encoded arguments
+    static void render(std::string & out, const char * format, const char * args, size_t len)
+    {
+        arg_reader r(args, len);
+        const char * f = format;
+
+        while (*f)
+        {
+            if (*f != '%')
+            {
+                const char * pct = strchr(f, '%');
+                size_t n = pct ? (size_t)(pct - f) : strlen(f);
+                out.append(f, n);
+                f += n;
+                continue;
+            }
+
+            if (f[1] == '%')
+            {
+                out += '%';
+                f += 2;
+                continue;
+            }
+
+            // %[flags][width][.precision][length]conversion
+            std::string spec("%");
+            const char * s = f + 1;
+            while (*s && strchr("-+ #0'", *s)) spec += *s++;
+            if (*s == '*') { spec += xs_int(r.next().i); ++s; }
+            while (*s >= '0' && *s <= '9') spec += *s++;
+            if (*s == '.')
+            {
+                spec += *s++;
+                if (*s == '*') { spec += xs_int(r.next().i); ++s; }
+                while (*s >= '0' && *s <= '9') spec += *s++;
+            }
+            while (*s && strchr("hlLqjzt", *s)) ++s;
+
+            char conv = *s;
+            if (conv == '\0') { out.append(f); break; }
+            f = s + 1;
+
+            arg_reader::value v = r.next();
+            switch (conv)
+            {
+            case 'd': case 'i':
+                spec += "ll"; spec += conv;
+                append_formatted(out, spec.c_str(), (long long)v.i);
+                break;
+            case 'u': case 'o': case 'x': case 'X':
+                spec += "ll"; spec += conv;
+                append_formatted(out, spec.c_str(), (unsigned long long)v.u);
+                break;
+            case 'c':
+                spec += conv;
+                append_formatted(out, spec.c_str(), (int)v.i);
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                spec += conv;
+                append_formatted(out, spec.c_str(), v.d);
+                break;
+            case 's':
+                if (v.tag == 's')
+                {
+                    std::string str(v.s, v.n);
+                    spec += conv;
+                    if (spec == "%s") out += str;
+                    else append_formatted(out, spec.c_str(), str.c_str());
+                }
+                else
+                {
+                    append_formatted(out, "%lld", (long long)v.i);
+                }
+                break;
+            case 'p':
+                spec += conv;
+                append_formatted(out, spec.c_str(), (void *)(uintptr_t)v.u);
+                break;
+            case 'n':
+                break;
+            default:
+                out += '%';
+                out += conv;
+                break;
+            }
+        }
+    }
+
+    // one conversion appended to out, as long as it comes out, as text mode writes it
+    template <class T>
+    static void append_formatted(std::string & out, const char * spec, T v)
+    {
+        int n = snprintf(NULL, 0, spec, v);
+        if (n <= 0) return;
+
+        size_t at = out.length();
+        out.resize(at + n + 1);
+        snprintf(&out[at], n + 1, spec, v);
+        out.resize(at + n);
+    }
+
+    // the text layout logger::Emit() produces for a record
+    static void render_line(std::string & out, const char * tsp, const char * severityTag
+        , int flags, const char * message, size_t len)
+    {
+        if (!(flags & LOG_FLAG_RAW))
+        {
+            out += tsp;
+            out += ' ';
+            out += severityTag;
+            if (severityTag[0]) out += ' ';
+        }
+        out.append(message, len);
+        if (flags & LOG_FLAG_LINEFEED) out += '\n';
+    }
+
+    // end of the last complete record of a binary log of `size` bytes in fd. a crash leaves the
+    // zero filled rest of a preallocated or mapped file behind the records; records can end in
+    // zero bytes themselves, so they are walked rather than the zeros trimmed.
+    static long records_end(int fd, long size)
+    {
+        std::vector<char> buff(1 << 16);
+        long base = 0, have = 0;
+
+        // the n bytes at pos, read in large pieces; NULL past the end
+        auto peek = [&](long pos, long n) -> const char *
+        {
+            if (pos + n > size) return NULL;
+            if (pos < base || pos + n > base + have)
+            {
+                base = pos;
+                have = std::min(size - pos, (long)buff.size());
+                if (pread(fd, &buff[0], have, pos) != have)
+                {
+                    have = 0;
+                    return NULL;
+                }
+            }
+            return &buff[pos - base];
+        };
+
+        const long head = 8 + sizeof(uint32_t) + sizeof(uint8_t);
+        const char * p = peek(0, head);
+        if (p == NULL || memcmp(p, IMSLOG_BINARY_MAGIC, 8) != 0)
+        {
+            // not even the header made it, or not a binary log: left alone
+            return p == NULL || p[0] != '\0' ? size : 0;
+        }
+
+        long at = head;
+        for (;;)
+        {
+            p = peek(at, 1);
+            long need = p == NULL ? 0 : *p == 'F' ? 9 : *p == 'R' ? 23 : *p == 'T' ? 19 : 0;
+            if (need == 0 || (p = peek(at, need)) == NULL) return at;
+
+            uint32_t len;
+            memcpy(&len, p + need - sizeof(len), sizeof(len));
+            if (at + need + (long)len > size) return at;
+            at += need + len;
+        }
+    }
+
+    // converts one binary log stream back to text, returns false on a malformed stream.
+    // zero bytes between records, the tail a crashed run left in a file it mapped, are skipped.
+    // severityTags is indexed by severity, as logSeverity__ in logger.h.
+    static bool decode(FILE * in, FILE * out, const char * const * severityTags, int maxSeverity)
+    {
+        char magic[8];
+        uint32_t order = 0;
+        uint8_t prec = 0;
+        if (fread(magic, 1, 8, in) != 8 || memcmp(magic, IMSLOG_BINARY_MAGIC, 8) != 0) return false;
+        if (fread(&order, sizeof(order), 1, in) != 1 || order != 0x01020304) return false;
+        if (fread(&prec, sizeof(prec), 1, in) != 1) return false;
+
+        std::vector<std::string> formats;
+        std::vector<char> body;
+        std::string text, line;
+        time_t lastSec = -1;
+        char tsp[40] = "";
+        int tsl = 0;
+
+        for (;;)
+        {
+            int tag = fgetc(in);
+            if (tag == EOF) return true;
+            if (tag == '\0') continue;
+
+            uint32_t id = 0, n = 0;
+            if (tag == 'F')
+            {
+                if (fread(&id, sizeof(id), 1, in) != 1 || fread(&n, sizeof(n), 1, in) != 1) return false;
+                body.resize(n);
+                if (n && fread(&body[0], 1, n, in) != n) return false;
+                if (formats.size() <= id) formats.resize(id + 1);
+                formats[id].assign(body.begin(), body.end());
+                continue;
+            }
+            if (tag != 'R' && tag != 'T') return false;
+            if (tag == 'R' && fread(&id, sizeof(id), 1, in) != 1) return false;
+
+            int64_t sec; int32_t nsec; uint8_t severity, flags;
+            if (fread(&sec, sizeof(sec), 1, in) != 1
+            ||  fread(&nsec, sizeof(nsec), 1, in) != 1
+            ||  fread(&severity, 1, 1, in) != 1
+            ||  fread(&flags, 1, 1, in) != 1
+            ||  fread(&n, sizeof(n), 1, in) != 1) return false;
+
+            body.resize(n + 1);
+            if (n && fread(&body[0], 1, n, in) != n) return false;
+            body[n] = '\0';
+
+            if ((time_t)sec != lastSec)
+            {
+                struct tm tm;
+                time_t t = (time_t)sec;
+                gmtime_r(&t, &tm);
+                tsl = snprintf(tsp, sizeof(tsp), "[%d-%02d-%02d %02d:%02d:%02d"
+                    , tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+                lastSec = (time_t)sec;
+            }
+            if (prec == 3) snprintf(tsp + tsl, sizeof(tsp) - tsl, ".%03d]", (int)(nsec / 1000000));
+            else if (prec == 6) snprintf(tsp + tsl, sizeof(tsp) - tsl, ".%06d]", (int)(nsec / 1000));
+            else snprintf(tsp + tsl, sizeof(tsp) - tsl, "]");
+
+            text.clear();
+            if (tag == 'R')
+            {
+                if (id >= formats.size()) return false;
+                render(text, formats[id].c_str(), &body[0], n);
+            }
+            else
+            {
+                text.assign(&body[0], n);
+            }
+
+            line.clear();
+            render_line(line, tsp, severityTags[severity > maxSeverity ? maxSeverity : severity]
+                , flags, text.data(), text.length());
+            fwrite(line.data(), 1, line.length(), out);
+        }
+    }
+
+private:
+    struct arg_reader
+    {
+        struct value
+        {
+            char tag;
+            int64_t i;
+            uint64_t u;
+            double d;
+            const char * s;
+            uint32_t n;
+        };
+
+        arg_reader(const char * args, size_t len) : p(args), end(args + len) {}
+
+        value next()
+        {
+            value v = { 0, 0, 0, 0.0, "", 0 };
+            if (p >= end) return v;
+
+            v.tag = *p++;
+            switch (v.tag)
+            {
+            case 'i':
+                {
+                    int32_t i; if (!take(&i, sizeof(i))) break;
+                    v.i = i; v.u = (uint32_t)i; v.d = i;
+                }
+                break;
+            case 'l':
+            case 'p':
+                {
+                    int64_t l; if (!take(&l, sizeof(l))) break;
+                    v.i = l; v.u = (uint64_t)l; v.d = (double)l;
+                }
+                break;
+            case 'd':
+                {
+                    double d; if (!take(&d, sizeof(d))) break;
+                    v.d = d; v.i = (int64_t)d; v.u = (uint64_t)v.i;
+                }
+                break;
+            case 's':
+                {
+                    uint32_t n; if (!take(&n, sizeof(n)) || p + n > end) { p = end; break; }
+                    v.s = p; v.n = n;
+                    p += n;
+                }
+                break;
+            default:
+                p = end;
+                break;
+            }
+            return v;
+        }
+
+        bool take(void * v, size_t n)
+        {
+            if (p + n > end) { p = end; return false; }
+            memcpy(v, p, n);
+            p += n;
+            return true;
+        }
+
+        const char * p;
+        const char * end;
+    };
+
+    static std::string xs_int(int64_t v)
+    {
+        char b[24];
+        snprintf(b, sizeof(b), "%lld", (long long)v);
+        return b;
+    }
+};
+
+#endif//IMSLOG_BINARY_H_INCLUDED__
@@ -0,0 +1,108 @@
+// log_compressor.h: compresses closed log segments on a background thread.
+//
+// jobs run an external compressor ("gzip" by default, which replaces <file> by <file>.gz)
+// one after another, so rotation in logger.h never waits for compression.
+
+#ifndef IMSLOG_COMPRESSOR_H_INCLUDED__
+#define IMSLOG_COMPRESSOR_H_INCLUDED__
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+extern char ** environ;
+
+class log_compressor
+{
+public:
+    log_compressor(const std::string & command = "gzip")
+        : mCommand(command)
+        , mStopping(false)
+    {
+    }
+
+    // pending jobs are still done before the destructor returns
+    ~log_compressor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            mStopping = true;
+            mCond.notify_one();
+        }
+        if (mThread.joinable()) mThread.join();
+    }
+
+    void push(const std::string & path)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mJobs.push_back(path);
+        if (!mThread.joinable()) mThread = std::thread(&log_compressor::Proc, this);
+        mCond.notify_one();
+    }
+
+    // file being compressed right now, or empty
+    std::string busy()
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mBusy;
+    }
+
+private:
+    void Proc()
+    {
+        std::unique_lock<std::mutex> lock(mLock);
+        for (;;)
+        {
+            mCond.wait(lock, [&]() { return mStopping || !mJobs.empty(); });
+            if (mJobs.empty()) break;
+
+            mBusy = mJobs.front();
+            mJobs.pop_front();
+            std::string path = mBusy;
+
+            lock.unlock();
+            Run(path);
+            lock.lock();
+            mBusy.clear();
+        }
+    }
+
+    void Run(const std::string & path)
+    {
+        if (access(path.c_str(), F_OK) != 0) return;  // pruned meanwhile
+
+        const char * argv[] = { mCommand.c_str(), "-f", path.c_str(), NULL };
+
+        pid_t pid;
+        int e = posix_spawnp(&pid, mCommand.c_str(), NULL, NULL, (char * const *)argv, environ);
+        if (e != 0)
+        {
+            fprintf(stderr, "cannot run '%s' on '%s': %s\n", mCommand.c_str(), path.c_str(), strerror(e));
+            return;
+        }
+
+        int status = 0;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            fprintf(stderr, "'%s -f %s' failed with status %d\n", mCommand.c_str(), path.c_str(), status);
+        }
+    }
+
+    std::string mCommand;
+    std::string mBusy;
+    std::deque<std::string> mJobs;
+    bool mStopping;
+    std::thread mThread;
+    std::mutex mLock;
+    std::condition_variable mCond;
+};
+
+#endif//IMSLOG_COMPRESSOR_H_INCLUDED__
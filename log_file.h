@@ -0,0 +1,386 @@
+// log_file.h: append-only log file backends used by logger.h.
+//
+// stdio_file  - FILE* opened for append, the classic behaviour.
+// mmap_file   - records are memcpy'ed into a shared mapping of a pre-sized window of the
+//               file; the window is remapped in large chunks, and the file is trimmed back
+//               to its real length on close. pages belong to the kernel, so what was written
+//               survives a crash of the process.
+// uring_file  - records are batched into io_uring writes, see uring_writer.h. io_uring is
+//               opt-in (IMSLOG_URING); without it a worker thread does the batched writes
+//               with pwritev().
+// append_file - raw O_APPEND descriptor, one write() per record. several processes can share
+//               the file: records never interleave, whoever writes them.
+
+#ifndef IMSLOG_FILE_H_INCLUDED__
+#define IMSLOG_FILE_H_INCLUDED__
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "log_binary.h"
+
+#include "uring_writer.h"
+
+class log_file
+{
+public:
+    enum kind {
+        stdio_file,
+        mmap_file,
+        append_file,
+        uring_file,
+    };
+
+    log_file() : mReserved(false) {}
+    virtual ~log_file() {}
+
+    // opens path for appending, false with errno set on failure
+    virtual bool open(const char * path) = 0;
+    virtual size_t write(const void * data, size_t len) = 0;
+    // for crash handlers: bypasses user space buffers, async-signal-safe
+    virtual void write_through(const void * data, size_t len) = 0;
+    // hand buffered data to the kernel
+    virtual void flush() = 0;
+    // flush, then make it durable
+    virtual void sync() = 0;
+    // closes the file, trimming anything reserved beyond the data
+    virtual void close() = 0;
+    virtual long size() const = 0;
+    virtual int fd() const = 0;
+    // other processes may append to the file as well
+    virtual bool shared() const { return false; }
+
+    // false once `path` names another file than the open one, e.g. renamed by another process
+    bool is(const char * path) const
+    {
+        struct stat a, b;
+        return fstat(fd(), &a) == 0 && stat(path, &b) == 0 && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+    }
+
+    // preallocate the file up to `bytes` so it does not fragment as it grows;
+    // KEEP_SIZE leaves the file length alone, appends go where they always did.
+    void reserve(long bytes)
+    {
+        #ifdef FALLOC_FL_KEEP_SIZE
+        if (bytes > size() && fallocate(fd(), FALLOC_FL_KEEP_SIZE, size(), bytes - size()) == 0)
+        {
+            mReserved = true;
+        }
+        #endif//FALLOC_FL_KEEP_SIZE
+    }
+
+    // textual: the file holds no NUL bytes, so a NUL tail left by a crash can be trimmed
+    static log_file * create(kind k, bool textual);
+
+protected:
+    // truncating to the current length gives back the blocks reserve() put beyond it
+    void release()
+    {
+        struct stat st;
+        if (mReserved && fstat(fd(), &st) == 0 && ftruncate(fd(), st.st_size) != 0) {}
+        mReserved = false;
+    }
+
+    bool mReserved;
+};
+
+class stdio_log_file : public log_file
+{
+public:
+    stdio_log_file() : mFile(NULL), mSize(0) {}
+    ~stdio_log_file() { close(); }
+
+    virtual bool open(const char * path)
+    {
+        close();
+        mFile = fopen(path, "ab");
+        if (mFile == NULL) return false;
+
+        // large enough for flushes to group many records
+        setvbuf(mFile, NULL, _IOFBF, 1 << 16);
+
+        fseek(mFile, 0, SEEK_END);
+        mSize = ftell(mFile);
+        return true;
+    }
+
+    virtual size_t write(const void * data, size_t len)
+    {
+        size_t n = fwrite(data, 1, len, mFile);
+        mSize += n;
+        return n;
+    }
+
+    virtual void write_through(const void * data, size_t len)
+    {
+        if (mFile && ::write(fileno(mFile), data, len) > 0) mSize += len;
+    }
+
+    virtual void flush() { fflush(mFile); }
+    virtual void sync() { fflush(mFile); fdatasync(fileno(mFile)); }
+
+    virtual void close()
+    {
+        if (mFile == NULL) return;
+
+        fflush(mFile);
+        release();
+        fclose(mFile);
+        mFile = NULL;
+    }
+
+    virtual long size() const { return mSize; }
+    virtual int fd() const { return mFile ? fileno(mFile) : -1; }
+
+private:
+    FILE * mFile;
+    long mSize;
+};
+
+class mmap_log_file : public log_file
+{
+public:
+    mmap_log_file(bool textual, size_t chunk = 8 << 20)
+        : mFd(-1)
+        , mTextual(textual)
+        , mChunk(chunk)
+        , mMap(NULL)
+        , mMapOffset(0)
+        , mMapLength(0)
+        , mSize(0)
+    {
+        long page = sysconf(_SC_PAGESIZE);
+        mChunk = (mChunk + page - 1) / page * page;
+    }
+
+    ~mmap_log_file() { close(); }
+
+    virtual bool open(const char * path)
+    {
+        close();
+        mFd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (mFd < 0) return false;
+
+        struct stat st;
+        if (fstat(mFd, &st) != 0)
+        {
+            close();
+            return false;
+        }
+
+        mSize = st.st_size;
+        if (mTextual) Recover();
+        else RecoverBinary();
+        return true;
+    }
+
+    virtual size_t write(const void * data, size_t len)
+    {
+        if (mMap == NULL || mSize + (long)len > mMapOffset + (long)mMapLength)
+        {
+            if (!Remap(len)) return 0;
+        }
+
+        memcpy(mMap + (mSize - mMapOffset), data, len);
+        mSize += len;
+        return len;
+    }
+
+    virtual void write_through(const void * data, size_t len)
+    {
+        write(data, len);
+    }
+
+    // nothing is buffered in user space
+    virtual void flush() {}
+
+    // msync() covers the current window only; pages of earlier windows, unmapped but maybe
+    // still dirty, and the file size need the fdatasync()
+    virtual void sync()
+    {
+        if (mMap) msync(mMap, mMapLength, MS_SYNC);
+        if (mFd >= 0) fdatasync(mFd);
+    }
+
+    virtual void close()
+    {
+        if (mFd < 0) return;
+
+        Unmap();
+        if (ftruncate(mFd, mSize) != 0) {}
+        mReserved = false;
+        ::close(mFd);
+        mFd = -1;
+    }
+
+    virtual long size() const { return mSize; }
+    virtual int fd() const { return mFd; }
+
+private:
+    // map a window starting at the page holding the end of data, large enough for len more bytes
+    bool Remap(size_t len)
+    {
+        Unmap();
+
+        long page = sysconf(_SC_PAGESIZE);
+        long offset = mSize / page * page;
+        size_t need = (size_t)(mSize - offset) + len;
+        size_t length = need <= mChunk ? mChunk : (need + mChunk - 1) / mChunk * mChunk;
+
+        struct stat st;
+        if (fstat(mFd, &st) != 0) return false;
+        if (st.st_size < offset + (long)length && ftruncate(mFd, offset + length) != 0) return false;
+
+        void * p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, mFd, offset);
+        if (p == MAP_FAILED) return false;
+
+        mMap = (char *)p;
+        mMapOffset = offset;
+        mMapLength = length;
+        return true;
+    }
+
+    void Unmap()
+    {
+        if (mMap == NULL) return;
+
+        munmap(mMap, mMapLength);
+        mMap = NULL;
+        mMapOffset = 0;
+        mMapLength = 0;
+    }
+
+    // a file not closed properly still has the NUL tail of its last window
+    void Recover()
+    {
+        char buff[4096];
+        while (mSize > 0)
+        {
+            long n = mSize < (long)sizeof(buff) ? mSize : (long)sizeof(buff);
+            if (pread(mFd, buff, n, mSize - n) != n) return;
+
+            long i = n;
+            while (i > 0 && buff[i - 1] == '\0') --i;
+
+            mSize -= n - i;
+            if (i > 0) break;
+        }
+    }
+
+    // binary records can end in zero bytes themselves, so they are walked instead; only when
+    // the file ends in one, a properly closed file was trimmed
+    void RecoverBinary()
+    {
+        char last;
+        if (mSize > 0 && pread(mFd, &last, 1, mSize - 1) == 1 && last == '\0')
+        {
+            mSize = log_binary::records_end(mFd, mSize);
+        }
+    }
+
+    int mFd;
+    bool mTextual;
+    size_t mChunk;
+    char * mMap;
+    long mMapOffset;
+    size_t mMapLength;
+    long mSize;
+};
+
+class append_log_file : public log_file
+{
+public:
+    append_log_file() : mFd(-1), mSize(0) {}
+    ~append_log_file() { close(); }
+
+    virtual bool open(const char * path)
+    {
+        close();
+        mFd = ::open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (mFd < 0) return false;
+
+        mSize = lseek(mFd, 0, SEEK_END);
+        return true;
+    }
+
+    // O_APPEND makes seek and write one step; the size is the file's, all writers included
+    virtual size_t write(const void * data, size_t len)
+    {
+        ssize_t n;
+        while ((n = ::write(mFd, data, len)) < 0 && errno == EINTR);
+        if (n < 0) return 0;
+
+        mSize = lseek(mFd, 0, SEEK_CUR);
+        return n;
+    }
+
+    virtual void write_through(const void * data, size_t len)
+    {
+        if (mFd >= 0 && ::write(mFd, data, len) > 0) mSize += len;
+    }
+
+    virtual void flush() {}
+    virtual void sync() { fdatasync(mFd); }
+
+    // no trimming: the length seen here may already be behind the other writers
+    virtual void close()
+    {
+        if (mFd < 0) return;
+
+        ::close(mFd);
+        mFd = -1;
+    }
+
+    virtual long size() const { return mSize; }
+    virtual int fd() const { return mFd; }
+    virtual bool shared() const { return true; }
+
+private:
+    int mFd;
+    long mSize;
+};
+
+class uring_log_file : public log_file
+{
+public:
+    ~uring_log_file() { close(); }
+
+    virtual bool open(const char * path) { return mWriter.open(path); }
+    virtual size_t write(const void * data, size_t len) { return mWriter.append(data, len); }
+    virtual void write_through(const void * data, size_t len) { mWriter.write_through(data, len); }
+
+    // submits, the write completes in the background
+    virtual void flush() { mWriter.flush(); }
+    virtual void sync() { mWriter.sync(); }
+
+    virtual void close()
+    {
+        if (mWriter.fd() < 0) return;
+
+        mWriter.drain();
+        release();
+        mWriter.close();
+    }
+
+    virtual long size() const { return mWriter.size(); }
+    virtual int fd() const { return mWriter.fd(); }
+
+private:
+    uring_writer mWriter;
+};
+
+inline log_file * log_file::create(kind k, bool textual)
+{
+    if (k == uring_file) return new uring_log_file;
+    if (k == mmap_file) return new mmap_log_file(textual);
+    if (k == append_file) return new append_log_file;
+    return new stdio_log_file;
+}
+
+#endif//IMSLOG_FILE_H_INCLUDED__
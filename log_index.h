@@ -0,0 +1,68 @@
+// log_index.h: sparse time index kept next to a log file, see logger::SetIndex.
+//
+// "<log file>.idx" is a flat array of { int64 second, int64 offset } in native byte order.
+// an entry is added before the first record of every new second and after every n records,
+// so seconds only grow along the file; offset is where that record starts in the log file.
+// finding a time window is a binary search in the index and a short scan of the log.
+
+#ifndef IMSLOG_INDEX_H_INCLUDED__
+#define IMSLOG_INDEX_H_INCLUDED__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#define IMSLOG_INDEX_SUFFIX ".idx"
+
+struct log_index_entry
+{
+    int64_t sec;
+    int64_t offset;
+
+    bool operator < (const log_index_entry & r) const { return sec < r.sec; }
+};
+
+class log_index
+{
+public:
+    static bool append(FILE * index, time_t sec, long offset)
+    {
+        log_index_entry e = { (int64_t)sec, (int64_t)offset };
+        return fwrite(&e, sizeof(e), 1, index) == 1;
+    }
+
+    // the whole index of a log file; false when there is none
+    static bool load(const std::string & logPath, std::vector<log_index_entry> & entries)
+    {
+        entries.clear();
+        FILE * f = fopen((logPath + IMSLOG_INDEX_SUFFIX).c_str(), "rb");
+        if (f == NULL) return false;
+
+        log_index_entry e;
+        while (fread(&e, sizeof(e), 1, f) == 1) entries.push_back(e);
+        fclose(f);
+        return true;
+    }
+
+    // where to start reading for records stamped `from` or later: the entry before the first
+    // one of `from`, since records of a second can be written a little out of order.
+    static long seek(const std::vector<log_index_entry> & entries, time_t from)
+    {
+        log_index_entry key = { (int64_t)from, 0 };
+        std::vector<log_index_entry>::const_iterator it = std::lower_bound(entries.begin(), entries.end(), key);
+        if (it == entries.begin()) return 0;
+        return (long)(--it)->offset;
+    }
+
+    // false when the indexed file has no record in [from, to] for sure
+    static bool overlaps(const std::vector<log_index_entry> & entries, time_t from, time_t to)
+    {
+        if (entries.empty()) return true;
+        return entries.front().sec <= (int64_t)to + 1 && entries.back().sec + 1 >= (int64_t)from;
+    }
+};
+
+#endif//IMSLOG_INDEX_H_INCLUDED__
@@ -0,0 +1,233 @@
+// log_recorder.h: always-on in-memory flight recorder for logger.h.
+//
+// every thread gets a fixed ring of recent records that were below the file level.
+// rings are never freed (a new thread reuses the ring of a finished one), so a dump can
+// walk them at any time, even from a crash signal handler. entries are guarded by a
+// sequence number; one that is overwritten while being read is skipped.
+
+#ifndef IMSLOG_RECORDER_H_INCLUDED__
+#define IMSLOG_RECORDER_H_INCLUDED__
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+#ifndef IMSLOG_RECORDER_TEXT
+#define IMSLOG_RECORDER_TEXT 256
+#endif//IMSLOG_RECORDER_TEXT
+
+class log_recorder
+{
+public:
+    struct entry
+    {
+        std::atomic<uint32_t> seq;  // odd while being written
+        timespec time;
+        int severity;
+        char text[IMSLOG_RECORDER_TEXT];
+    };
+
+    struct ring
+    {
+        ring(int n) : entries(new entry [n]), depth(n), next(0), dumped(0), owned(true)
+        {
+            for (int i=0; i<n; ++i) entries[i].seq.store(0, std::memory_order_relaxed);
+        }
+
+        entry * entries;
+        int depth;
+        std::atomic<uint64_t> next;     // entries written so far
+        std::atomic<uint64_t> dumped;   // entries before this were dumped already
+        std::atomic<bool> owned;
+    };
+
+    // a copy of one entry, as collected for a dump
+    struct item
+    {
+        timespec time;
+        int severity;
+        std::string text;
+
+        bool operator < (const item & r) const
+        {
+            return time.tv_sec < r.time.tv_sec || (time.tv_sec == r.time.tv_sec && time.tv_nsec < r.time.tv_nsec);
+        }
+    };
+
+    static void record(int depth, const timespec & ts, int severity, const char * format, va_list vl)
+    {
+        ring * r = local(depth);
+        uint64_t n = r->next.load(std::memory_order_relaxed);
+        entry & e = r->entries[n % r->depth];
+
+        uint32_t seq = e.seq.load(std::memory_order_relaxed);
+        e.seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        e.time = ts;
+        e.severity = severity;
+        vsnprintf(e.text, sizeof(e.text), format, vl);
+
+        e.seq.store(seq + 2, std::memory_order_release);
+        r->next.store(n + 1, std::memory_order_release);
+    }
+
+    // entries of all threads not dumped before, in time order; marks them dumped
+    static void collect(std::vector<item> & out)
+    {
+        std::lock_guard<std::mutex> lock(registry_lock());
+        std::vector<ring *> & rs = registry();
+        for (size_t i=0; i<rs.size(); ++i)
+        {
+            ring * r = rs[i];
+            uint64_t end = r->next.load(std::memory_order_acquire);
+            uint64_t begin = r->dumped.load(std::memory_order_relaxed);
+            if (end - begin > (uint64_t)r->depth) begin = end - r->depth;
+
+            for (uint64_t n = begin; n < end; ++n)
+            {
+                item it;
+                if (read(r->entries[n % r->depth], it)) out.push_back(it);
+            }
+            r->dumped.store(end, std::memory_order_relaxed);
+        }
+
+        std::stable_sort(out.begin(), out.end());
+    }
+
+    // for crash handlers: no locks, no allocation. each pending entry is formatted into
+    // a stack buffer and handed to put(context, line, length), thread after thread.
+    static void dump_unsafe(void (* put)(void *, const char *, size_t), void * context
+        , const char * const * severityTags, int maxSeverity)
+    {
+        std::vector<ring *> & rs = registry();
+        for (size_t i=0; i<rs.size(); ++i)
+        {
+            ring * r = rs[i];
+            uint64_t end = r->next.load(std::memory_order_acquire);
+            uint64_t begin = r->dumped.load(std::memory_order_relaxed);
+            if (end - begin > (uint64_t)r->depth) begin = end - r->depth;
+
+            for (uint64_t n = begin; n < end; ++n)
+            {
+                entry & e = r->entries[n % r->depth];
+                uint32_t seq = e.seq.load(std::memory_order_acquire);
+                if (seq & 1) continue;
+
+                char line[IMSLOG_RECORDER_TEXT + 64];
+                size_t len = format_safe(line, sizeof(line), e
+                    , severityTags[e.severity > maxSeverity ? maxSeverity : e.severity]);
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (e.seq.load(std::memory_order_relaxed) != seq) continue;
+                put(context, line, len);
+            }
+            r->dumped.store(end, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    static bool read(entry & e, item & it)
+    {
+        uint32_t seq = e.seq.load(std::memory_order_acquire);
+        if (seq & 1) return false;
+
+        it.time = e.time;
+        it.severity = e.severity;
+        it.text.assign(e.text, strnlen(e.text, sizeof(e.text)));
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return e.seq.load(std::memory_order_relaxed) == seq;
+    }
+
+    // "[YYYY-MM-DD hh:mm:ss] <tag> <text>\n" using nothing but arithmetic
+    static size_t format_safe(char * buf, size_t cap, const entry & e, const char * tag)
+    {
+        int64_t t = e.time.tv_sec;
+        int64_t days = t / 86400, secs = t % 86400;
+        if (secs < 0) { secs += 86400; --days; }
+
+        // civil date from days since the epoch (H. Hinnant's algorithm)
+        int64_t z = days + 719468;
+        int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+        int64_t doe = z - era * 146097;
+        int64_t yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+        int64_t doy = doe - (365*yoe + yoe/4 - yoe/100);
+        int64_t mp = (5*doy + 2) / 153;
+        int d = (int)(doy - (153*mp + 2)/5 + 1);
+        int m = (int)(mp < 10 ? mp + 3 : mp - 9);
+        int y = (int)(yoe + era * 400 + (m <= 2));
+
+        char * p = buf;
+        char * end = buf + cap - 1;
+        *p++ = '[';
+        p = put_int(p, y, 4); *p++ = '-';
+        p = put_int(p, m, 2); *p++ = '-';
+        p = put_int(p, d, 2); *p++ = ' ';
+        p = put_int(p, (int)(secs / 3600), 2); *p++ = ':';
+        p = put_int(p, (int)(secs / 60 % 60), 2); *p++ = ':';
+        p = put_int(p, (int)(secs % 60), 2); *p++ = ']';
+        *p++ = ' ';
+        for (const char * s = tag; *s && p < end; ) *p++ = *s++;
+        if (tag[0] && p < end) *p++ = ' ';
+        for (size_t i = 0; i < sizeof(e.text) && e.text[i] && p < end; ++i) *p++ = e.text[i];
+        if (p > buf && p[-1] != '\n') *p++ = '\n';
+        return p - buf;
+    }
+
+    static char * put_int(char * p, int v, int width)
+    {
+        for (int i = width - 1; i >= 0; --i, v /= 10) p[i] = (char)('0' + v % 10);
+        return p + width;
+    }
+
+    static std::vector<ring *> & registry()
+    {
+        static std::vector<ring *> rings__;
+        return rings__;
+    }
+
+    static std::mutex & registry_lock()
+    {
+        static std::mutex lock__;
+        return lock__;
+    }
+
+    // gives the ring back for reuse when its thread ends
+    struct owner
+    {
+        owner() : r(NULL) {}
+        ~owner() { if (r) r->owned.store(false); }
+        ring * r;
+    };
+
+    static ring * local(int depth)
+    {
+        static thread_local owner owner__;
+        if (owner__.r) return owner__.r;
+
+        std::lock_guard<std::mutex> lock(registry_lock());
+        std::vector<ring *> & rs = registry();
+        for (size_t i=0; i<rs.size(); ++i)
+        {
+            bool free = false;
+            if (rs[i]->depth == depth && rs[i]->owned.compare_exchange_strong(free, true))
+            {
+                owner__.r = rs[i];
+                return owner__.r;
+            }
+        }
+
+        owner__.r = new ring(depth);
+        rs.push_back(owner__.r);
+        return owner__.r;
+    }
+};
+
+#endif//IMSLOG_RECORDER_H_INCLUDED__
@@ -0,0 +1,267 @@
+// log_sink.h: outputs of logger.h besides the log file.
+//
+// a sink gets every record at or above its own level, after the file write and outside
+// the logger's lock. each sink serializes itself, so a slow one only delays its caller;
+// wrap it in a queued_sink to take it off the caller's thread altogether.
+//
+// memory_sink  - the last n lines, for tests and status pages.
+// socket_sink  - syslog style datagrams to a local unix socket, never blocks.
+// queued_sink  - runs another sink on a thread of its own, dropping when it falls behind.
+// the console sink lives in logger.h, next to the terminal color handling.
+
+#ifndef IMSLOG_SINK_H_INCLUDED__
+#define IMSLOG_SINK_H_INCLUDED__
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "log_binary.h"
+
+// one record as the sinks see it; the pointers live as long as the write() call
+struct log_event
+{
+    timespec time;
+    int severity;
+    const char * timestamp;     // "[YYYY-MM-DD hh:mm:ss]"
+    const char * tag;           // "[WARNING]", empty for some severities
+    const char * message;
+    size_t length;
+    bool raw;                   // no timestamp and tag
+    bool lineEnd;               // ends the line, with lineFeed appended
+    const char * lineFeed;
+
+    // the line as the text log file has it
+    void compose(std::string & out) const
+    {
+        int flags = (raw ? LOG_FLAG_RAW : 0) | (lineEnd && lineFeed[0] ? LOG_FLAG_LINEFEED : 0);
+        log_binary::render_line(out, timestamp, tag, flags, message, length);
+    }
+};
+
+class log_sink
+{
+public:
+    // a negative level follows the level given to logger::setup()
+    log_sink(int level = -1) : mLevel(level) {}
+    virtual ~log_sink() {}
+
+    virtual void write(const log_event & e) = 0;
+    virtual void flush() {}
+
+    int level() const { return mLevel.load(std::memory_order_relaxed); }
+    void set_level(int level) { mLevel.store(level, std::memory_order_relaxed); }
+
+private:
+    std::atomic<int> mLevel;
+};
+
+class memory_sink : public log_sink
+{
+public:
+    memory_sink(size_t capacity, int level = -1)
+        : log_sink(level)
+        , mCapacity(capacity)
+    {
+    }
+
+    virtual void write(const log_event & e)
+    {
+        std::string line;
+        e.compose(line);
+
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mLines.size() >= mCapacity) mLines.pop_front();
+        mLines.push_back(line);
+    }
+
+    // oldest first
+    std::vector<std::string> lines()
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        return std::vector<std::string>(mLines.begin(), mLines.end());
+    }
+
+private:
+    size_t mCapacity;
+    std::deque<std::string> mLines;
+    std::mutex mLock;
+};
+
+class socket_sink : public log_sink
+{
+public:
+    // path of a SOCK_DGRAM unix socket, as /dev/log; `ident` prefixes every message
+    socket_sink(const std::string & path, const std::string & ident, int level = -1)
+        : log_sink(level)
+        , mIdent(ident)
+        , mFd(socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0))
+        , mDropped(0)
+    {
+        memset(&mAddr, 0, sizeof(mAddr));
+        mAddr.sun_family = AF_UNIX;
+        strncpy(mAddr.sun_path, path.c_str(), sizeof(mAddr.sun_path) - 1);
+    }
+
+    ~socket_sink()
+    {
+        if (mFd >= 0) close(mFd);
+    }
+
+    // "<pri>ident: text", facility user; the receiver adds its own time stamp
+    virtual void write(const log_event & e)
+    {
+        static const int pri[] = { 7, 7, 6, 4, 3, 2, 5 };
+        int severity = e.severity < 0 || e.severity > 6 ? 5 : e.severity;
+
+        std::string msg;
+        char head[16];
+        snprintf(head, sizeof(head), "<%d>", 8 + pri[severity]);
+        msg += head;
+        msg += mIdent;
+        msg += ": ";
+        msg.append(e.message, e.length);
+
+        // a datagram goes whole or not at all, so no lock is needed
+        if (mFd < 0 || sendto(mFd, msg.data(), msg.length(), MSG_DONTWAIT | MSG_NOSIGNAL
+            , (const sockaddr *)&mAddr, sizeof(mAddr)) < 0)
+        {
+            mDropped++;
+        }
+    }
+
+    // messages the socket did not take: receiver missing or too slow
+    size_t dropped() const { return mDropped.load(); }
+
+private:
+    std::string mIdent;
+    int mFd;
+    sockaddr_un mAddr;
+    std::atomic<size_t> mDropped;
+};
+
+class queued_sink : public log_sink
+{
+public:
+    // takes ownership of `sink`; at most `capacity` records wait for it, the rest are dropped.
+    // the level is the wrapped sink's.
+    queued_sink(log_sink * sink, size_t capacity)
+        : log_sink(sink->level())
+        , mSink(sink)
+        , mCapacity(capacity)
+        , mStopping(false)
+        , mBusy(false)
+        , mDropped(0)
+    {
+        mThread = std::thread(&queued_sink::Proc, this);
+    }
+
+    // records already queued are still written
+    ~queued_sink()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            mStopping = true;
+            mCond.notify_one();
+        }
+        mThread.join();
+        delete mSink;
+    }
+
+    virtual void write(const log_event & e)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mEvents.size() >= mCapacity)
+        {
+            mDropped++;
+            return;
+        }
+
+        mEvents.push_back(event(e));
+        mCond.notify_one();
+    }
+
+    // returns once the queue has been written out
+    virtual void flush()
+    {
+        std::unique_lock<std::mutex> lock(mLock);
+        mIdle.wait(lock, [&]() { return mEvents.empty() && !mBusy; });
+        mSink->flush();
+    }
+
+    size_t dropped() const { return mDropped.load(); }
+
+private:
+    // a log_event with copies of its strings
+    struct event
+    {
+        event(const log_event & e)
+            : e(e)
+            , timestamp(e.timestamp)
+            , tag(e.tag)
+            , message(e.message, e.length)
+            , lineFeed(e.lineFeed)
+        {
+        }
+
+        const log_event & get()
+        {
+            e.timestamp = timestamp.c_str();
+            e.tag = tag.c_str();
+            e.message = message.data();
+            e.lineFeed = lineFeed.c_str();
+            return e;
+        }
+
+        log_event e;
+        std::string timestamp;
+        std::string tag;
+        std::string message;
+        std::string lineFeed;
+    };
+
+    void Proc()
+    {
+        std::unique_lock<std::mutex> lock(mLock);
+        for (;;)
+        {
+            mCond.wait(lock, [&]() { return mStopping || !mEvents.empty(); });
+            if (mEvents.empty()) break;
+
+            event ev = mEvents.front();
+            mEvents.pop_front();
+            mBusy = true;
+
+            lock.unlock();
+            mSink->write(ev.get());
+            lock.lock();
+
+            mBusy = false;
+            if (mEvents.empty()) mIdle.notify_all();
+        }
+    }
+
+    log_sink * mSink;
+    size_t mCapacity;
+    std::deque<event> mEvents;
+    bool mStopping;
+    bool mBusy;
+    std::atomic<size_t> mDropped;
+    std::thread mThread;
+    std::mutex mLock;
+    std::condition_variable mCond;
+    std::condition_variable mIdle;
+};
+
+#endif//IMSLOG_SINK_H_INCLUDED__
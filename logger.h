@@ -14,19 +14,41 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
 #include <strings.h>
 #include <time.h>
 #include <errno.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#endif
+#include <poll.h>
 #include <stdexcept>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
 
 #include "xs.hxx"
 #include "lock.hxx"
 #include "auto.hxx"
 #include "errno_error.hxx"
 #include "win32_error.hxx"
+#include "mpsc_ring.hxx"
+#include "log_binary.h"
+#include "log_compressor.h"
+#include "log_file.h"
+#include "log_recorder.h"
+#include "log_sink.h"
+#include "log_index.h"
 
 using namespace imsux;
 
@@ -38,6 +60,23 @@ using namespace imsux;
 #define LSV_FATAL	5
 #define LSV_UNKNOWN 6
 #define LSV_MAX     LSV_UNKNOWN
+
+// statements below this severity are compiled out of the LOGx macros entirely
+#ifndef IMSLOG_MIN_LEVEL
+#define IMSLOG_MIN_LEVEL LSV_DEBUG
+#endif//IMSLOG_MIN_LEVEL
+
+// printf-style format checking of format string f against arguments starting at a
+#if defined(__GNUC__) || defined(__clang__)
+#define IMSLOG_PRINTF(f, a) __attribute__((format(printf, f, a)))
+#else
+#define IMSLOG_PRINTF(f, a)
+#endif
+
+// message capacity of one queued record in async mode
+#ifndef IMSLOG_RECORD_SIZE
+#define IMSLOG_RECORD_SIZE 1024
+#endif//IMSLOG_RECORD_SIZE
 static const char * logSeverity__[] = {
     "[DEBUG]",
     "",
@@ -112,6 +151,154 @@ int GetFullPathName(const char * path, int bufLen, char * buf, char ** fileName)
 #define MAX_PATH 260
 #endif//_WIN32
 
+// cheap wall clock for log stamps, coarse (jiffy resolution) unless sub-second digits are wanted
+inline timespec log_clock(int precision = 0)
+{
+    timespec ts;
+    #ifdef CLOCK_REALTIME_COARSE
+    clock_gettime(precision > 0 ? CLOCK_REALTIME : CLOCK_REALTIME_COARSE, &ts);
+    #else
+    clock_gettime(CLOCK_REALTIME, &ts);
+    #endif//CLOCK_REALTIME_COARSE
+    return ts;
+}
+
+// "[YYYY-MM-DD hh:mm:ss]", optionally with .mmm or .uuuuuu;
+// the calendar part is rebuilt only when the second changes.
+struct log_timestamp
+{
+    log_timestamp() : sec(-1), len(0) { text[0] = '\0'; }
+
+    const char * format(const timespec & ts, int precision)
+    {
+        if (ts.tv_sec != sec)
+        {
+            struct tm tm;
+            gmtime_r(&ts.tv_sec, &tm);
+            len = snprintf(text, sizeof(text), "[%d-%02d-%02d %02d:%02d:%02d"
+                , tm.tm_year+1900
+                , tm.tm_mon+1
+                , tm.tm_mday
+                , tm.tm_hour
+                , tm.tm_min
+                , tm.tm_sec
+            );
+            sec = ts.tv_sec;
+        }
+
+        char * p = text + len;
+        if (precision == 3)
+        {
+            p += snprintf(p, 8, ".%03d", (int)(ts.tv_nsec / 1000000));
+        }
+        else if (precision == 6)
+        {
+            p += snprintf(p, 8, ".%06d", (int)(ts.tv_nsec / 1000));
+        }
+        p[0] = ']';
+        p[1] = '\0';
+        return text;
+    }
+
+    // one cache per thread, so no lock is needed to use it
+    static log_timestamp & local()
+    {
+        static thread_local log_timestamp stamp;
+        return stamp;
+    }
+
+    time_t sec;
+    int len;
+    char text[40];
+};
+
+// a named category of records with a level of its own, see logger::Module()
+struct log_module
+{
+    log_module(const std::string & n, int l) : name(n), mLevel(l) {}
+
+    // negative: follow the logger's level
+    int level() const { return mLevel.load(std::memory_order_relaxed); }
+    void set_level(int level) { mLevel.store(level, std::memory_order_relaxed); }
+
+    const std::string name;
+
+private:
+    std::atomic<int> mLevel;
+};
+
+// the colored echo of records on stdout, under a lock of its own
+class console_sink : public log_sink
+{
+public:
+    console_sink(int level = -1) : log_sink(level)
+    {
+        mColorful = colorful();
+
+        #ifdef _WIN32
+        CONSOLE_SCREEN_BUFFER_INFO csbi = { 0 };
+        mStdHandle = GetStdHandle(STD_OUTPUT_HANDLE);
+        GetConsoleScreenBufferInfo(mStdHandle, &csbi);
+        mNormalTextAttribute = csbi.wAttributes;
+        #else
+        mNormalTextAttribute = resetAttribute__;
+        mStdHandle = stdout;
+        #endif//_WIN32
+    }
+
+    ~console_sink() { restore(); }
+
+    virtual void write(const log_event & e)
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (mColorful) adjust(e.severity);
+        if (e.raw)
+        {
+            printf("%s", e.message);
+        }
+        else
+        {
+            printf("%s %s", e.timestamp, e.message);
+        }
+        if (mColorful && e.lineEnd) restore();
+        if (e.lineEnd) printf("%s", e.lineFeed);
+    }
+
+    virtual void flush()
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        fflush(stdout);
+    }
+
+    #ifndef _WIN32
+    static inline bool colorful()
+    {
+        static bool colorful = getenv("TERM")
+            &&(strncmp(getenv("TERM"), "xterm", 5) == 0
+            || strcmp (getenv("TERM"), "rxvt" ) == 0
+            || strcmp (getenv("TERM"), "linux") == 0);
+        
+        return colorful;
+    }
+    #endif //!_WIN32
+
+    void adjust(int severity)
+    {
+        SetConsoleTextAttribute(mStdHandle, severityAttr__[severity]);
+    }
+
+    void restore()
+    {
+        SetConsoleTextAttribute(mStdHandle, mNormalTextAttribute);
+    }
+
+private:
+    bool mColorful;
+    HANDLE mStdHandle;
+    CONSOLE_ATTRIBUTE mNormalTextAttribute;
+    std::mutex mLock;
+};
+
 class logger
 {
 public:
@@ -125,34 +312,121 @@ public:
         anually,
     };
 
-public:
-    logger() : mFile(NULL)
+    // file i/o counters, to compare durability settings
+    struct file_stats
     {
-        mTermColorful = TermColorful();
+        uint64_t records;
+        uint64_t flushes;   // buffered records handed to the kernel
+        uint64_t syncs;     // fdatasync()/msync() calls
+    };
 
-        #ifdef _WIN32
-        CONSOLE_SCREEN_BUFFER_INFO csbi = { 0 };
-        mStdHandle = GetStdHandle(STD_OUTPUT_HANDLE);
-        GetConsoleScreenBufferInfo(mStdHandle, &csbi);
-        mNormalTextAttribute = csbi.wAttributes;
-        #else
-        mNormalTextAttribute = resetAttribute__;
-        mStdHandle = stdout;
-        #endif//_WIN32
+    // the logger's own counters, see Metrics()
+    struct metrics
+    {
+        enum { latency_buckets = 32 };
+
+        uint64_t records[LSV_MAX + 1];  // written to the file, per severity
+        uint64_t bytes[LSV_MAX + 1];
+        uint64_t opens;                 // log files opened
+        uint64_t rotations;             // fixed_size segments closed
+        uint64_t openErrors;
+        uint64_t writeErrors;           // short writes and failed renames
+        uint64_t dropped;               // async queue overflow
+        // time spent in WriteV()/WriteB() including the lock wait; bucket i counts calls
+        // that took less than 2^i ns (and at least 2^(i-1)), the last one anything longer.
+        uint64_t latency[latency_buckets];
 
+        // upper bound in ns of the bucket holding the given fraction (0.5, 0.99) of the calls
+        uint64_t latency_percentile(double fraction) const
+        {
+            uint64_t total = 0;
+            for (int i=0; i<latency_buckets; ++i) total += latency[i];
+
+            uint64_t seen = 0;
+            for (int i=0; i<latency_buckets; ++i)
+            {
+                seen += latency[i];
+                if (total && seen >= total * fraction) return (uint64_t)1 << i;
+            }
+            return 0;
+        }
+    };
+
+    // what a producer does when the async queue is full
+    enum overflow {
+        overflow_block,     // wait for the writer thread
+        overflow_drop,      // drop the record and count it
+        overflow_drop_low,  // drop records below LSV_WARNING, block for the others
+    };
+
+public:
+    logger()
+        : mFile(NULL)
+        , mFileKind(log_file::stdio_file)
+        , mCheckedAt(-1)
+        , mIndex(NULL)
+        , mIndexEvery(0)
+        , mIndexedAt(-1)
+        , mIndexCount(0)
+        , mSizeLimit(64 << 20)
+        , mSegments(8)
+        , mRotatedAt(-1)
+        , mRotateSeq(0)
+        , mLevel(LSV_TRACE)
+        , mPrecision(0)
+        , mBinary(false)
+        , mRecordLevel(LSV_MAX + 1)
+        , mRecordDepth(0)
+        , mReportEvery(0)
+        , mReportAt(0)
+        , mFlushEvery(1)
+        , mFlushMillis(0)
+        , mFlushLevel(LSV_ERROR)
+        , mSyncOnRotate(false)
+        , mUnflushed(0)
+        , mFlushedAt(0)
+        , mFlusherStopping(false)
+        , mSharded(false)
+        , mShardGeneration(0)
+        , mWatcherStopping(false)
+        , mOverflow(overflow_block)
+        , mDropped(0)
+        , mWritten(0)
+        , mFlushWaiters(0)
+        , mStopping(false)
+        , mWriterIdle(false)
+        , mSpaceWaiters(0)
+    {
+        mConsole = new console_sink;
+        mSinks.push_back(mConsole);
+        UpdateLevels();
+
+        mCompressor = new log_compressor("gzip");
+        memset(&mFileStats, 0, sizeof(mFileStats));
+        memset(&mMetrics, 0, sizeof(mMetrics));
+        for (int i=0; i<metrics::latency_buckets; ++i) mLatency[i] = 0;
         InitializeCriticalSection(&mLock);
     }
 
     ~logger()
     {
-        RestoreConsoleAttr();
+        StopWriter();
+        StopFlusher();
+        StopWatcher();
+        for (size_t i=0; i<mSinks.size(); ++i) delete mSinks[i];
         DeleteCriticalSection(&mLock);
     }
 
-    void setup(int logLevel = LSV_TRACE, const std::string & logFile = "", rotation policy = as_is)
+    // asyncQueue > 0 turns on async mode: records are queued (up to asyncQueue of them)
+    // and a dedicated thread does all the file & console output.
+    void setup(int logLevel = LSV_TRACE, const std::string & logFile = "", rotation policy = as_is
+        , int asyncQueue = 0, overflow onFull = overflow_block)
     {
         if (logFile.length() != 0) SetLogName(logFile);
-        if (policy == fixed_size) throw std::invalid_argument("rotation policy `fixed_size` not implemented");
+        if (asyncQueue < 0) throw std::invalid_argument("invalid async queue length.");
+        if (asyncQueue > 0 && mSharded) throw std::invalid_argument("sharded logs are written by their threads, not a writer thread.");
+
+        StopWriter();
 
         mLevel = logLevel;
         mPolicy = policy;
@@ -166,30 +440,85 @@ public:
                 mLevel = sev;
             }
         }
+        UpdateLevels();
+
+        // last, the writer thread reads the level and policy set above
+        if (asyncQueue > 0)
+        {
+            mOverflow = onFull;
+            mQueue = new mpsc_ring<record>(asyncQueue);
+            mStopping = false;
+            mWriter = std::thread(&logger::WriterProc, this);
+        }
     }
 
-    #ifndef _WIN32
-    static inline bool TermColorful()
+    // barrier: returns once everything logged before the call is written out. in async mode
+    // the writer is waited for first, the file and sinks are flushed the same way then.
+    void flush()
     {
-        static bool colorful = getenv("TERM")
-            &&(strncmp(getenv("TERM"), "xterm", 5) == 0
-            || strcmp (getenv("TERM"), "rxvt" ) == 0
-            || strcmp (getenv("TERM"), "linux") == 0);
-        
-        return colorful;
+        if (mQueue.get())
+        {
+            size_t ticket = mQueue->claimed();
+            std::unique_lock<std::mutex> lock(mIdleLock);
+            mFlushWaiters++;
+            mWriterIdle = false;
+            mIdleCond.notify_one();
+            mFlushCond.wait(lock, [&]() { return mWritten.load() >= ticket || !mWriter.joinable(); });
+            mFlushWaiters--;
+        }
+
+        CriticalSectionLocker lock(mLock);
+        _ims_lock(CriticalSectionLocker, lock)
+        {
+            if (mFile.get()) FlushFile();
+        }
+        for (size_t i=0; i<mSinks.size(); ++i) mSinks[i]->flush();
+    }
+
+    // adds an output besides the file and the console, the logger owns it from now on.
+    // like setup(), this is meant for start up: it must not race with logging.
+    void AddSink(log_sink * sink)
+    {
+        mSinks.push_back(sink);
+        UpdateLevels();
+    }
+
+    // the stdout echo; console().set_level(LSV_MAX + 1) silences it
+    console_sink & console() { return *mConsole; }
+
+    // to be called after the level of a sink changed
+    void UpdateLevels()
+    {
+        int sinks = LSV_MAX + 1;
+        for (size_t i=0; i<mSinks.size(); ++i) sinks = std::min(sinks, SinkLevel(mSinks[i]));
+        mSinkLevel = sinks;
+        mGateLevel = std::min(mLevel.load(), sinks);
     }
+
+    // records dropped so far because the async queue was full
+    size_t dropped() const { return mDropped.load(); }
+
+    #ifndef _WIN32
+    static inline bool TermColorful() { return console_sink::colorful(); }
     #endif //!_WIN32
 
-    void AdjustConsoleAttr(int severity)
+    void AdjustConsoleAttr(int severity) { mConsole->adjust(severity); }
+    void RestoreConsoleAttr() { mConsole->restore(); }
+
+    // cheap test done by the LOGx macros before any argument gets evaluated
+    bool Enabled(int severity) const
     {
-        SetConsoleTextAttribute(mStdHandle, severityAttr__[severity]);
+        return severity >= mGateLevel || severity >= mRecordLevel || severity == LSV_UNKNOWN;
     }
 
-    void RestoreConsoleAttr()
+    bool Enabled(const log_module & module, int severity) const
     {
-        SetConsoleTextAttribute(mStdHandle, mNormalTextAttribute);
+        int level = module.level();
+        if (level < 0) return Enabled(severity);
+        return severity >= level || severity >= mRecordLevel || severity == LSV_UNKNOWN;
     }
 
+    IMSLOG_PRINTF(3, 4)
     void Write(int severity, const char * format, ...)
     {
         va_list vl;
@@ -198,6 +527,7 @@ public:
         va_end(vl);
     }
 
+    IMSLOG_PRINTF(3, 4)
     void WriteLine(int severity, const char * format, ...)
     {
         va_list vl;
@@ -206,6 +536,7 @@ public:
         va_end(vl);
     }
 
+    IMSLOG_PRINTF(3, 4)
     void WriteRaw(int lineEnd, const char * format, ...)
     {
         va_list vl;
@@ -214,160 +545,1425 @@ public:
         va_end(vl);
     }
 
-    template<int BUFFSIZE=1024>
-    void WriteV(int raw, int lineEnd, int severity, const char * format, va_list vl)
+    // an empty raw line, for LOGENDL; WriteRaw(1, "") would warn of a zero-length format
+    void EndLine()
     {
-        if (severity < mLevel && severity != LSV_UNKNOWN) return;
-
-        struct tm * t = CheckLogName();
-        if (t == NULL) return;
+        RawFallback(1, "");
+    }
 
-        char message[BUFFSIZE];
-        vsnprintf(message, BUFFSIZE, format, vl);
+    // entry of the LOGx macros. in binary mode a record is the site id plus the encoded
+    // arguments, formatting is left to the decoder; oversized or dynamic formats fall back to text.
+    template<class... A>
+    void Log(const log_site & site, int severity, const char * format, const A &... args)
+    {
+        if (!Enabled(severity)) return;
+        if (severity >= mLevel && LogBinary(site, severity, format, args...)) return;
 
-        const char * lineFeed = "";
-        int fmtlen = strlen(format);
-        if (lineEnd && format[fmtlen - 1] != '\n') lineFeed = "\n";
+        WriteFallback(severity, format, args...);
+    }
 
-        struct tm & tm= *t;
-        xs tsp ("[%d-%02d-%02d %02d:%02d:%02d]"
-            , tm.tm_year+1900
-            , tm.tm_mon+1
-            , tm.tm_mday
-            , tm.tm_hour
-            , tm.tm_min
-            , tm.tm_sec
-        );
-        CriticalSectionLocker lock(mLock);
-        _ims_lock(CriticalSectionLocker, lock)
+    // entry of the MLOGx macros: the module's level, when it has one, decides alone
+    // whether a record goes to the file; sinks still apply their own levels.
+    template<class... A>
+    void LogModule(const log_module & module, const log_site & site, int severity, const char * format, const A &... args)
+    {
+        int level = module.level();
+        if (level < 0)
         {
-            if (mFile.get())
-            {
-                if (!raw) fprintf(mFile
-                    , "%s %s%s"
-                    , tsp.s
-                    , logSeverity__[severity]
-                    , logSeverity__[severity][0] ? " " : ""
-                );
-
-                fprintf(mFile, "%s%s", message, lineFeed);
-                fflush(mFile);
-            }
+            Log(site, severity, format, args...);
+            return;
+        }
 
-            // handle stdout
-            if (mTermColorful) AdjustConsoleAttr(severity);
-            if (raw)
-            {
-                printf("%s", message);
-            }
-            else
-            {
-                printf("%s %s", tsp.s, message);
-            }
-            if (mTermColorful && lineEnd) RestoreConsoleAttr();
-            if (lineEnd) printf("%s", lineFeed);
+        if (severity < level && severity != LSV_UNKNOWN)
+        {
+            if (severity >= mRecordLevel) RecordFallback(severity, format, args...);
+            return;
         }
+
+        if (LogBinary(site, severity, format, args...)) return;
+        SubmitFallback(severity, format, args...);
     }
 
-    struct tm * CheckLogName()
+    // the binary mode record of a site, false when it has to be text after all. the site's
+    // id stands for the format it saw first; another pointer with the same text (a literal
+    // need not be the same object every time) shares it, a format computed at run time that
+    // differs from the first one has no id and is written as text.
+    template<class... A>
+    bool LogBinary(const log_site & site, int severity, const char * format, const A &... args)
     {
-        time_t now = time(NULL);
-        struct tm * t = gmtime(&now);
-        if (mBaseName.length() == 0 || mPolicy <= timestamped && mFile.get()) return t;
+        if (!mBinary || site.args < 0) return false;
+        if (format != site.format && strcmp(format, site.format) != 0) return false;
 
-        xs expectedLogFileName = [&]() {
-            char woy[4] = { 0 };
-            switch (mPolicy)
-            {
-                case daily:
-                    return xs("%s.%d%02d%02d%s", mBaseName.c_str(), t->tm_year+1900, t->tm_mon+1, t->tm_mday, mBaseExt.c_str());
-                case weekly:
-                    strftime(woy, sizeof(woy), "%w", t);
-                    return xs("%s.%dW%s%s", mBaseName.c_str(), t->tm_year+1900, woy, mBaseExt.c_str());
-                case monthly:
-                    return xs("%s.%d%02d%s", mBaseName.c_str(), t->tm_year+1900, t->tm_mon+1, mBaseExt.c_str());
-                case anually:
-                    return xs("%s.%d%s", mBaseName.c_str(), t->tm_year+1900, mBaseExt.c_str());
-                default:
-                    return xs("%s%s", mBaseName.c_str(), mBaseExt.c_str());
-            }
-        }();
+        char buff[IMSLOG_RECORD_SIZE];
+        buff[0] = '\0';
+        log_arg_writer w(buff, sizeof(buff), site);
+        w.args(args...);
+        if (w.full) return false;
+
+        WriteB(site, severity, buff, w.length());
+        return true;
+    }
 
-        if (mLogFile != expectedLogFileName.s)
+    // entry of the rate limited and sampled LOGx macros: `suppressed` records of the site were
+    // held back since its last one, the count goes at the end of this line.
+    template<class... A>
+    void LogLimited(const log_site & site, int severity, unsigned suppressed, const char * format, const A &... args)
+    {
+        if (suppressed == 0)
         {
-            mFile = fopen(xs("%s/%s", mLogDir.c_str(), expectedLogFileName.s), "a+t");
-            if (mFile.get() == NULL)
-            {
-                fprintf(stderr, "cannot open log file '%s': %s"
-                    , expectedLogFileName.s
-                    , strerror(errno));
-            }
-            else
-            {
-                mLogFile = expectedLogFileName.s;
-            }
+            Log(site, severity, format, args...);
+            return;
         }
 
-        return t;
+        if (!Enabled(severity)) return;
+
+        // the record is formatted first, its text must not live in the buffer WriteV() formats into
+        static thread_local std::string summary__;
+        FormatTo(summary__, format, args...);
+        summary__ += xs(" (%u similar suppressed)", suppressed).s;
+        WriteFallback(severity, "%s", summary__.c_str());
     }
 
-    void SetLogName(const std::string & logName)
+    void WriteB(const log_site & site, int severity, const char * args, size_t len)
     {
-        if (logName.length() == 0)
+        latency_probe probe(mLatency);
+        if (mQueue.get())
         {
-            throw std::invalid_argument("not a valid log file name.");
+            record * r = Claim(severity);
+            if (r == NULL) return;
+
+            r->time = log_clock(mPrecision);
+            r->severity = severity;
+            r->site = &site;
+            r->spill = NULL;
+            r->length = len;
+            memcpy(r->message, args, len);
+            mQueue->commit(r);
+
+            if (mWriterIdle.load(std::memory_order_relaxed)) WakeWriter();
+            return;
         }
 
-        char * fname = NULL;
-        char full[MAX_PATH];
-        GetFullPathName(logName.c_str(), sizeof(full)/sizeof(full[0]), full, &fname);
+        EmitB(log_clock(mPrecision), severity, site, args, len);
+    }
 
-        mBaseName = fname;
-        char * dot = strrchr(fname, '.');
-        if (dot)
+    // records have no length limit; BUFFSIZE is left over from the stack buffer they were
+    // once formatted into, and kept so that WriteV<N>() and LOGX<N> still compile.
+    template<int BUFFSIZE=1024>
+    void WriteV(int raw, int lineEnd, int severity, const char * format, va_list vl)
+    {
+        bool toFile = severity >= mLevel || severity == LSV_UNKNOWN;
+        if (!toFile)
         {
-            dot[0] = '\0';
-            mBaseName = fname;
-            dot[0] = '.';
-            if (dot[1]) mBaseExt = dot;
+            if (severity >= mRecordLevel)
+            {
+                va_list copy;
+                va_copy(copy, vl);
+                log_recorder::record(mRecordDepth, log_clock(mPrecision), severity, format, copy);
+                va_end(copy);
+            }
+            if (severity < mSinkLevel) return;
         }
-        if (mPolicy == timestamped)
+
+        Submit(raw, lineEnd, severity, toFile, format, vl);
+    }
+
+    // a record past the level checks; toFile is false for one only the sinks take
+    void Submit(int raw, int lineEnd, int severity, bool toFile, const char * format, va_list vl)
+    {
+        latency_probe probe(mLatency);
+
+        const char * lineFeed = "";
+        int fmtlen = strlen(format);
+        if (lineEnd && (fmtlen == 0 || format[fmtlen - 1] != '\n')) lineFeed = "\n";
+
+        if (mQueue.get())
         {
-            mBaseName = xs("%s.%ld", mBaseName.c_str(), (long)time(NULL)).s;
+            record * r = Claim(severity);
+            if (r == NULL) return;
+
+            r->time = log_clock(mPrecision);
+            r->raw = raw;
+            r->lineEnd = lineEnd;
+            r->lineFeed = lineFeed[0] != '\0';
+            r->severity = severity;
+            r->toFile = toFile;
+            r->site = NULL;
+            r->spill = NULL;
+
+            // a record longer than the slot goes to the heap, the writer frees it
+            va_list copy;
+            va_copy(copy, vl);
+            int n = vsnprintf(r->message, sizeof(r->message), format, copy);
+            va_end(copy);
+            if (n >= (int)sizeof(r->message))
+            {
+                r->spill = (char *)malloc(n + 1);
+                if (r->spill) vsnprintf(r->spill, n + 1, format, vl);
+            }
+            mQueue->commit(r);
+
+            if (mWriterIdle.load(std::memory_order_relaxed)) WakeWriter();
+            return;
         }
 
-        if (mBaseExt.length() == 0) mBaseExt = ".log";
-        fname[0] = '\x0';
-        mLogDir = full;
+        size_t length = 0;
+        const char * message = FormatV(length, format, vl);
 
-        if (!CreateDirectory(mLogDir.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+        Emit(log_clock(mPrecision), raw, lineEnd, severity, message, lineFeed, toFile);
+    }
+
+    // formats into a per-thread buffer that grows to the longest record seen and is reused,
+    // so there is no allocation in steady state; a second pass runs only after an overflow.
+    static const char * FormatV(size_t & length, const char * format, va_list vl)
+    {
+        static thread_local std::vector<char> buff__(IMSLOG_RECORD_SIZE);
+
+        va_list copy;
+        va_copy(copy, vl);
+        int n = vsnprintf(&buff__[0], buff__.size(), format, copy);
+        va_end(copy);
+
+        if (n < 0)
         {
-            throw errno_error(xs("CreateDirectory('%s') failed: ", mLogDir.c_str()).s);
+            buff__[0] = '\0';
+            n = 0;
+        }
+        else if ((size_t)n >= buff__.size())
+        {
+            buff__.resize(n + 1);
+            vsnprintf(&buff__[0], buff__.size(), format, vl);
         }
 
-        // printf("LogBaseName: %s%s\n", mBaseName.c_str(), mBaseExt.c_str());
-        // printf("LogDir: %s\n", mLogDir.c_str());
+        length = n;
+        return &buff__[0];
     }
 
-private:
-    scoped_ptr <FILE, file_dtor> mFile;
-    
-    std::string mBaseName;
-    std::string mBaseExt;
-    std::string mLogDir;
-    std::string mLogFile;
+    // the actual output of one record, on the caller's thread in sync mode
+    // or on the writer thread in async mode.
+    void Emit(const timespec & now, int raw, int lineEnd, int severity, const char * message, const char * lineFeed, bool toFile = true)
+    {
+        const char * tsp = log_timestamp::local().format(now, mPrecision);
 
-    rotation mPolicy;
-    int mSizeLimit;
-    int mLevel;
-    bool mTermColorful;
+        if (mSharded)
+        {
+            if (toFile) EmitShard(now, tsp, raw, severity, message, lineFeed);
 
-    CRITICAL_SECTION mLock;
-    HANDLE mStdHandle;
-    CONSOLE_ATTRIBUTE mNormalTextAttribute;
-};
+            log_event e = { now, severity, tsp, logSeverity__[severity], message, strlen(message), raw != 0, lineEnd != 0, lineFeed };
+            Dispatch(e);
+            return;
+        }
 
-#ifndef _WIN32
+        CriticalSectionLocker lock(mLock);
+        _ims_lock(CriticalSectionLocker, lock)
+        {
+            CheckLogName(now.tv_sec);
+            if (severity == LSV_FATAL && mRecordDepth) DumpRecorderLocked();
+
+            if (mFile.get() && toFile)
+            {
+                mLine.clear();
+                if (mBinary)
+                {
+                    int flags = (raw ? LOG_FLAG_RAW : 0) | (lineEnd ? LOG_FLAG_LINEEND : 0) | (lineFeed[0] ? LOG_FLAG_LINEFEED : 0);
+                    log_binary::append_record(mLine, NULL, now, severity, flags, message, strlen(message));
+                }
+                else
+                {
+                    int lf = lineFeed[0] ? LOG_FLAG_LINEFEED : 0;
+                    log_binary::render_line(mLine, tsp, logSeverity__[severity], (raw ? LOG_FLAG_RAW : 0) | lf, message, strlen(message));
+                }
+
+                WriteFile(now, severity);
+                // the record may have rotated the file, the report waits for the next one then
+                if (mReportEvery && now.tv_sec >= mReportAt && mFile.get()) SelfReport(now);
+            }
+        }
+
+        log_event e = { now, severity, tsp, logSeverity__[severity], message, strlen(message), raw != 0, lineEnd != 0, lineFeed };
+        Dispatch(e);
+    }
+
+    // the kernel thread id on Linux, as ps and top show it; elsewhere the process id and a
+    // number counted per thread, unique among processes sharing the directory too
+    static std::string ShardThreadId()
+    {
+#ifdef __linux__
+        return xs("%ld", (long)syscall(SYS_gettid)).s;
+#else
+        static std::atomic<long> next__(0);
+        static thread_local long id__ = ++next__;
+        return xs("%ld-%ld", (long)getpid(), id__).s;
+#endif
+    }
+
+    // sharded mode: the calling thread writes its own file, no lock involved
+    void EmitShard(const timespec & now, const char * tsp, int raw, int severity, const char * message, const char * lineFeed)
+    {
+        static thread_local shard shard__;
+        shard & sh = shard__;
+
+        int generation = mShardGeneration.load(std::memory_order_acquire);
+        if (sh.owner != this || sh.generation != generation)
+        {
+            sh.file = NULL;
+            sh.name.clear();
+            sh.owner = this;
+            sh.generation = generation;
+            sh.checkedAt = -1;
+        }
+
+        if (now.tv_sec != sh.checkedAt && mBaseName.length())
+        {
+            std::string name = LogFileName(now.tv_sec, xs(".t%s", ShardThreadId().c_str()).s);
+            if (name != sh.name)
+            {
+                sh.file = NULL;
+                sh.file = log_file::create(mFileKind, true);
+                if (!sh.file->open(xs("%s/%s", mLogDir.c_str(), name.c_str())))
+                {
+                    sh.file = NULL;
+                    fprintf(stderr, "cannot open log shard '%s': %s\n", name.c_str(), strerror(errno));
+                }
+                else
+                {
+                    sh.name = name;
+                }
+            }
+            if (sh.file.get()) sh.checkedAt = now.tv_sec;
+        }
+
+        if (sh.file.get() == NULL) return;
+
+        sh.line.clear();
+        int lf = lineFeed[0] ? LOG_FLAG_LINEFEED : 0;
+        log_binary::render_line(sh.line, tsp, logSeverity__[severity], (raw ? LOG_FLAG_RAW : 0) | lf, message, strlen(message));
+        sh.file->write(sh.line.data(), sh.line.length());
+
+        if (++sh.unflushed >= mFlushEvery || (severity >= mFlushLevel && severity != LSV_UNKNOWN))
+        {
+            sh.file->flush();
+            sh.unflushed = 0;
+        }
+    }
+
+    // output of a binary record; it is rendered as text only when some sink wants it.
+    void EmitB(const timespec & now, int severity, const log_site & site, const char * args, size_t len)
+    {
+        const char * tsp = log_timestamp::local().format(now, mPrecision);
+        size_t fmtlen = strlen(site.format);
+        const char * lineFeed = fmtlen == 0 || site.format[fmtlen - 1] != '\n' ? "\n" : "";
+
+        std::string text;
+        bool echo = severity >= mSinkLevel;
+        if (echo) log_binary::render(text, site.format, args, len);
+
+        CriticalSectionLocker lock(mLock);
+        _ims_lock(CriticalSectionLocker, lock)
+        {
+            CheckLogName(now.tv_sec);
+            if (severity == LSV_FATAL && mRecordDepth) DumpRecorderLocked();
+
+            if (mFile.get())
+            {
+                mLine.clear();
+                if (mDefined.size() <= (size_t)site.id) mDefined.resize(site.id + 1);
+                if (!mDefined[site.id])
+                {
+                    log_binary::append_format(mLine, site);
+                    mDefined[site.id] = true;
+                }
+
+                int flags = LOG_FLAG_LINEEND | (lineFeed[0] ? LOG_FLAG_LINEFEED : 0);
+                log_binary::append_record(mLine, &site, now, severity, flags, args, len);
+                WriteFile(now, severity);
+                // the record may have rotated the file, the report waits for the next one then
+                if (mReportEvery && now.tv_sec >= mReportAt && mFile.get()) SelfReport(now);
+            }
+        }
+
+        if (echo)
+        {
+            log_event e = { now, severity, tsp, logSeverity__[severity], text.c_str(), text.length(), false, true, lineFeed };
+            Dispatch(e);
+        }
+    }
+
+    // hands a record to each sink that takes its severity, outside mLock
+    void Dispatch(const log_event & e)
+    {
+        if (e.severity < mSinkLevel && e.severity != LSV_UNKNOWN) return;
+
+        for (size_t i=0; i<mSinks.size(); ++i)
+        {
+            if (e.severity >= SinkLevel(mSinks[i]) || e.severity == LSV_UNKNOWN) mSinks[i]->write(e);
+        }
+    }
+
+    int SinkLevel(const log_sink * sink) const
+    {
+        return sink->level() < 0 ? mLevel.load() : sink->level();
+    }
+
+    // file part of a record, composed in mLine and written in one piece; called with mLock held
+    void WriteFile(const timespec & now, int severity)
+    {
+        if (mFile.get() == NULL) return;
+
+        // entries stay in time order for the binary search, a record stamped before the last
+        // entry (queued a while, or the clock stepped back) is indexed at the entry's second
+        if (mIndex.get() && (now.tv_sec > mIndexedAt || ++mIndexCount >= mIndexEvery))
+        {
+            mIndexedAt = std::max(now.tv_sec, mIndexedAt);
+            log_index::append(mIndex.get(), mIndexedAt, mFile->size());
+            mIndexCount = 0;
+        }
+
+        if (mFile->write(mLine.data(), mLine.length()) != mLine.length()) mMetrics.writeErrors++;
+        mFileStats.records++;
+        mMetrics.records[severity]++;
+        mMetrics.bytes[severity] += mLine.length();
+        mUnflushed++;
+
+        int64_t ms = now.tv_sec * (int64_t)1000 + now.tv_nsec / 1000000;
+        if (mUnflushed >= mFlushEvery
+        || (severity >= mFlushLevel && severity != LSV_UNKNOWN)
+        || (mFlushMillis > 0 && ms - mFlushedAt >= mFlushMillis))
+        {
+            FlushFile();
+            mFlushedAt = ms;
+        }
+
+        if (mPolicy == fixed_size && mFile->size() >= mSizeLimit) RotateSegment(now.tv_sec);
+    }
+
+    void FlushFile()
+    {
+        if (mUnflushed == 0 || mFile.get() == NULL) return;
+
+        mFile->flush();
+        if (mIndex.get()) fflush(mIndex.get());
+        mFileStats.flushes++;
+        mUnflushed = 0;
+    }
+
+    // every file change goes through here, so rotation can make the old file durable
+    void CloseFile()
+    {
+        if (mFile.get() == NULL) return;
+
+        if (mSyncOnRotate)
+        {
+            mFile->sync();
+            mFileStats.syncs++;
+        }
+        mUnflushed = 0;
+        mFile = NULL;
+        mIndex = NULL;
+    }
+
+    // recorded context goes to the file ahead of the record that triggered the dump
+    void DumpRecorderLocked()
+    {
+        std::vector<log_recorder::item> items;
+        log_recorder::collect(items);
+        if (items.empty() || mFile.get() == NULL) return;
+
+        timespec now = log_clock(mPrecision);
+        RawLine(now, xs("---- flight recorder: %d record(s) ----\n", (int)items.size()));
+        for (size_t i=0; i<items.size(); ++i)
+        {
+            if (!ReopenRotated(now)) return;
+            TextLine(items[i].time, items[i].severity, items[i].text.data(), items[i].text.length());
+        }
+        if (!ReopenRotated(now)) return;
+        RawLine(now, "---- flight recorder end ----\n");
+        FlushFile();
+
+        // the record that triggered the dump comes next
+        ReopenRotated(now);
+    }
+
+    // a line written may have rotated the file; false when none could be opened again
+    bool ReopenRotated(const timespec & now)
+    {
+        if (mFile.get() == NULL) CheckLogName(now.tv_sec);
+        return mFile.get() != NULL;
+    }
+
+    // a record of the logger's own, file only; called with mLock held
+    void TextLine(const timespec & now, int severity, const char * text, size_t len)
+    {
+        mLine.clear();
+        if (mBinary)
+        {
+            log_binary::append_record(mLine, NULL, now, severity, LOG_FLAG_LINEEND | LOG_FLAG_LINEFEED, text, len);
+        }
+        else
+        {
+            const char * tsp = log_timestamp::local().format(now, mPrecision);
+            log_binary::render_line(mLine, tsp, logSeverity__[severity], LOG_FLAG_LINEFEED, text, len);
+        }
+        WriteFile(now, severity);
+    }
+
+    void SelfReport(const timespec & now)
+    {
+        mReportAt = now.tv_sec + mReportEvery;
+
+        metrics m = MetricsLocked();
+        uint64_t records = 0, bytes = 0;
+        for (int i=0; i<=LSV_MAX; ++i)
+        {
+            records += m.records[i];
+            bytes += m.bytes[i];
+        }
+
+        xs text("logger: %llu records, %llu bytes, %llu opens, %llu rotations, %llu errors, %llu dropped, write p50 < %lluns, p99 < %lluns"
+            , (unsigned long long)records
+            , (unsigned long long)bytes
+            , (unsigned long long)m.opens
+            , (unsigned long long)m.rotations
+            , (unsigned long long)(m.openErrors + m.writeErrors)
+            , (unsigned long long)m.dropped
+            , (unsigned long long)m.latency_percentile(0.5)
+            , (unsigned long long)m.latency_percentile(0.99)
+        );
+        TextLine(now, LSV_INFO, text.s, strlen(text.s));
+    }
+
+    void RawLine(const timespec & now, const char * text)
+    {
+        mLine.clear();
+        if (mBinary) log_binary::append_record(mLine, NULL, now, 0, LOG_FLAG_RAW, text, strlen(text));
+        else mLine = text;
+        WriteFile(now, 0);
+    }
+
+    // "<base>[.<period>][<shard>]<ext>" for the given time under the rotation policy
+    std::string LogFileName(time_t now, const char * shard = "") const
+    {
+        struct tm tm;
+        struct tm * t = gmtime_r(&now, &tm);
+
+        xs period = [&]() {
+            char woy[4] = { 0 };
+            switch (mPolicy)
+            {
+                case daily:
+                    return xs(".%d%02d%02d", t->tm_year+1900, t->tm_mon+1, t->tm_mday);
+                case weekly:
+                    strftime(woy, sizeof(woy), "%w", t);
+                    return xs(".%dW%s", t->tm_year+1900, woy);
+                case monthly:
+                    return xs(".%d%02d", t->tm_year+1900, t->tm_mon+1);
+                case anually:
+                    return xs(".%d", t->tm_year+1900);
+                default:
+                    return xs("%s", "");
+            }
+        }();
+
+        return xs("%s%s%s%s", mBaseName.c_str(), period.s, shard, mBaseExt.c_str()).str();
+    }
+
+    // file names only change on second boundaries, so the check runs once per second at most
+    void CheckLogName(time_t now = time(NULL))
+    {
+        if (now == mCheckedAt) return;
+        if (mBaseName.length() == 0 || mPolicy <= timestamped && mFile.get()) return;
+
+        std::string expected = LogFileName(now);
+        if (mBinary) expected += IMSLOG_BINARY_SUFFIX;
+
+        // another process sharing the file rotated it away under us
+        bool moved = mFile.get() && mFile->shared() && !mFile->is(xs("%s/%s", mLogDir.c_str(), mLogFile.c_str()));
+
+        if (mLogFile != expected || moved)
+        {
+            CloseFile();
+            mFile = log_file::create(mFileKind, !mBinary);
+            if (!mFile->open(xs("%s/%s", mLogDir.c_str(), expected.c_str())))
+            {
+                mFile = NULL;
+                mMetrics.openErrors++;
+                fprintf(stderr, "cannot open log file '%s': %s"
+                    , expected.c_str()
+                    , strerror(errno));
+            }
+            else
+            {
+                mLogFile = expected;
+                mMetrics.opens++;
+                if (mBinary)
+                {
+                    // formats are defined again in every file, so each one decodes on its own
+                    mDefined.clear();
+                    if (mFile->size() == 0)
+                    {
+                        mLine.clear();
+                        log_binary::append_header(mLine, mPrecision);
+                        mFile->write(mLine.data(), mLine.length());
+                    }
+                }
+                if (mPolicy == fixed_size && !mFile->shared()) mFile->reserve(mSizeLimit);
+
+                // offsets of a file others append to would not be ours to record
+                if (mIndexEvery && !mFile->shared())
+                {
+                    mIndex = fopen(xs("%s/%s%s", mLogDir.c_str(), expected.c_str(), IMSLOG_INDEX_SUFFIX), "ab");
+                    mIndexedAt = -1;
+                    mIndexCount = 0;
+                }
+            }
+        }
+
+        if (mFile.get()) mCheckedAt = now;
+    }
+
+    // fixed_size rotation: the active file is closed as a segment once it reaches
+    // `bytes`, at most `segments` files (the active one included) are kept.
+    // closed segments are handed to `compressor` (empty for none) on a background thread.
+    void SetSizeLimit(int bytes, int segments = 8, const std::string & compressor = "gzip")
+    {
+        if (bytes <= 0) throw std::invalid_argument("invalid log size limit.");
+        if (segments < 2) throw std::invalid_argument("at least 2 log segments are needed.");
+
+        // the replaced compressor finishes its jobs as it is destroyed, after the lock is released
+        scoped_ptr <log_compressor, new_dtor<log_compressor> > replaced;
+        CriticalSectionLocker lock(mLock);
+        _ims_lock(CriticalSectionLocker, lock)
+        {
+            mSizeLimit = bytes;
+            mSegments = segments;
+            replaced = mCompressor.detach();
+            mCompressor = compressor.length() ? new log_compressor(compressor) : NULL;
+        }
+    }
+
+    // when written records reach the disk: a flush happens after `flushEvery` records,
+    // after `flushMillis` ms (0: off) or for a record at `flushLevel` or above;
+    // syncOnRotate fdatasync()s each file as it is closed. default is a flush per record.
+    void SetDurability(int flushEvery, int flushMillis = 0, int flushLevel = LSV_ERROR, bool syncOnRotate = false)
+    {
+        if (flushEvery <= 0 || flushMillis < 0) throw std::invalid_argument("invalid durability settings.");
+
+        StopFlusher();
+        CriticalSectionLocker lock(mLock);
+        _ims_lock(CriticalSectionLocker, lock)
+        {
+            mFlushEvery = flushEvery;
+            mFlushMillis = flushMillis;
+            mFlushLevel = flushLevel;
+            mSyncOnRotate = syncOnRotate;
+        }
+
+        // records left in the buffer while logging is quiet still get flushed in time
+        if (flushMillis > 0)
+        {
+            mFlusherStopping = false;
+            mFlusher = std::thread(&logger::FlusherProc, this);
+        }
+    }
+
+    file_stats FileStats()
+    {
+        file_stats fs;
+        CriticalSectionLocker lock(mLock);
+        _ims_lock(CriticalSectionLocker, lock)
+        {
+            fs = mFileStats;
+        }
+        return fs;
+    }
+
+    // snapshot of the counters since the logger was created
+    metrics Metrics()
+    {
+        CriticalSectionLocker lock(mLock);
+        _ims_lock(CriticalSectionLocker, lock)
+        {
+            return MetricsLocked();
+        }
+        return metrics();
+    }
+
+    // writes the counters as a LSV_INFO line at most every `seconds` (0: never), along with
+    // the records that get logged anyway.
+    void SetSelfReport(int seconds)
+    {
+        if (seconds < 0) throw std::invalid_argument("invalid self report interval.");
+
+        CriticalSectionLocker lock(mLock);
+        _ims_lock(CriticalSectionLocker, lock)
+        {
+            mReportEvery = seconds;
+            mReportAt = time(NULL) + seconds;
+        }
+    }
+
+    // flight recorder: records from `level` up to (not including) the file level are kept
+    // in a per-thread ring of `depth` entries, with no I/O. the rings go to the log file
+    // ahead of a LSV_FATAL record, on DumpRecorder(), or from InstallCrashHandler()'s handler.
+    // depth 0 turns it off.
+    void SetRecorder(int level, int depth = 256)
+    {
+        if (level < 0 || level > LSV_MAX || depth < 0) throw std::invalid_argument("invalid flight recorder settings.");
+
+        mRecordDepth = depth;
+        mRecordLevel = depth ? level : LSV_MAX + 1;
+    }
+
+    void DumpRecorder()
+    {
+        CriticalSectionLocker lock(mLock);
+        _ims_lock(CriticalSectionLocker, lock)
+        {
+            CheckLogName(time(NULL));
+            DumpRecorderLocked();
+        }
+    }
+
+    // dumps the flight recorder when the process crashes, then lets the signal take its course
+    static void InstallCrashHandler()
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = &logger::CrashHandler;
+        sa.sa_flags = SA_RESETHAND;
+        sigemptyset(&sa.sa_mask);
+
+        int sigs[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+        for (size_t i=0; i<sizeof(sigs)/sizeof(sigs[0]); ++i) sigaction(sigs[i], &sa, NULL);
+    }
+
+    // sub-second digits in the time stamp: 0, 3 (milliseconds) or 6 (microseconds)
+    void SetTimePrecision(int digits)
+    {
+        if (digits != 0 && digits != 3 && digits != 6)
+        {
+            throw std::invalid_argument("time stamp precision must be 0, 3 or 6.");
+        }
+
+        mPrecision = digits;
+    }
+
+    // binary mode: LOGx records are written unformatted to "<log name>.bin" files,
+    // see log_binary.h and tools/imslog_decode.cpp. call it before the first record.
+    // unless given a level of its own, the console then only echoes LSV_WARNING and above.
+    void SetBinary(bool binary)
+    {
+        if (binary && mSharded) throw std::invalid_argument("sharded logs are for text and sync mode.");
+        if (binary && mFileKind == log_file::append_file) throw std::invalid_argument("binary logs cannot be shared.");
+
+        CriticalSectionLocker lock(mLock);
+        _ims_lock(CriticalSectionLocker, lock)
+        {
+            mBinary = binary;
+            CloseFile();
+            mLogFile.clear();
+            mCheckedAt = -1;
+        }
+
+        if (binary && mConsole->level() < 0) mConsole->set_level(LSV_WARNING);
+        UpdateLevels();
+    }
+
+    // how log files are written: stdio (default), appends into a memory mapped window,
+    // batched io_uring writes (a flush only submits them; worth it when flushes are spaced,
+    // a flush per record costs more than stdio; io_uring needs IMSLOG_URING, a pwritev()
+    // worker does them otherwise), or O_APPEND writes for a file shared by several
+    // processes. binary files cannot be shared, the format ids of each process would clash.
+    void SetFileBackend(log_file::kind kind)
+    {
+        if (kind == log_file::append_file && mBinary) throw std::invalid_argument("binary logs cannot be shared.");
+
+        CriticalSectionLocker lock(mLock);
+        _ims_lock(CriticalSectionLocker, lock)
+        {
+            mFileKind = kind;
+            CloseFile();
+            mLogFile.clear();
+            mCheckedAt = -1;
+        }
+    }
+
+    // writes "<log file>.idx" next to each log file: the offset of the first record of every
+    // second, and of every `everyRecords`-th record in between (0 turns it off). see
+    // log_index.h and tools/imslog_range.cpp. files shared by several processes get none.
+    void SetIndex(int everyRecords)
+    {
+        if (everyRecords < 0) throw std::invalid_argument("invalid index interval.");
+
+        CriticalSectionLocker lock(mLock);
+        _ims_lock(CriticalSectionLocker, lock)
+        {
+            mIndexEvery = everyRecords;
+            CloseFile();
+            mLogFile.clear();
+            mCheckedAt = -1;
+        }
+    }
+
+    // the module of that name, created on first use; references stay valid for the logger's
+    // lifetime, so keep one per call site (see IMSLOG_MODULE) rather than looking it up each time.
+    log_module & Module(const std::string & name)
+    {
+        std::lock_guard<std::mutex> lock(mModulesLock);
+        for (size_t i=0; i<mModules.size(); ++i)
+        {
+            if (mModules[i].name == name) return mModules[i];
+        }
+
+        std::map<std::string, int>::const_iterator it = mModuleLevels.find(name);
+        mModules.emplace_back(name, it == mModuleLevels.end() ? -1 : it->second);
+        return mModules.back();
+    }
+
+    // reads "<module> = <level>" lines, '#' starting a comment. a level is a severity name
+    // (DEBUG, TRACE, INFO, WARNING, ERROR, FATAL) or number, module "*" is the logger's own
+    // level. modules left out follow the logger again. false, and nothing changed, on errors.
+    bool LoadLevels(const std::string & path)
+    {
+        scoped_ptr<FILE, file_dtor> f(fopen(path.c_str(), "rt"));
+        if (f.get() == NULL)
+        {
+            fprintf(stderr, "cannot open level file '%s': %s\n", path.c_str(), strerror(errno));
+            return false;
+        }
+
+        std::map<std::string, int> levels;
+        char buff[256];
+        for (int n = 1; fgets(buff, sizeof(buff), f.get()); ++n)
+        {
+            char * hash = strchr(buff, '#');
+            if (hash) *hash = '\0';
+
+            char name[128], level[32], rest[2];
+            int fields = sscanf(buff, " %127[^= \t] = %31s %1s", name, level, rest);
+            if (fields <= 0) continue;
+
+            int sev = fields == 2 ? ParseLevel(level) : -1;
+            if (sev < 0)
+            {
+                fprintf(stderr, "%s:%d: expected '<module> = <level>'.\n", path.c_str(), n);
+                return false;
+            }
+            levels[name] = sev;
+        }
+
+        std::lock_guard<std::mutex> lock(mModulesLock);
+        mModuleLevels = levels;
+        for (size_t i=0; i<mModules.size(); ++i)
+        {
+            std::map<std::string, int>::const_iterator it = levels.find(mModules[i].name);
+            mModules[i].set_level(it == levels.end() ? -1 : it->second);
+        }
+
+        std::map<std::string, int>::const_iterator all = levels.find("*");
+        if (all != levels.end())
+        {
+            mLevel = all->second;
+            UpdateLevels();
+        }
+        return true;
+    }
+
+    // loads `path` now and again whenever it is written or replaced (inotify, Linux only), or
+    // when the process gets `sig` (0: none), which works everywhere. the watching thread only
+    // does the file I/O; filtering keeps reading the levels with plain atomic loads.
+    void WatchLevels(const std::string & path, int sig = SIGHUP)
+    {
+        StopWatcher();
+        LoadLevels(path);
+
+        if (sig)
+        {
+            struct sigaction sa;
+            memset(&sa, 0, sizeof(sa));
+            sa.sa_handler = &logger::ReloadHandler;
+            sa.sa_flags = SA_RESTART;
+            sigemptyset(&sa.sa_mask);
+            sigaction(sig, &sa, NULL);
+        }
+
+        mWatcherStopping = false;
+        mWatcher = std::thread(&logger::WatcherProc, this, path);
+    }
+
+    // sharded mode: every thread writes "<base>[.<period>].t<tid><ext>" on its own (<tid> as
+    // ShardThreadId()), without the logger lock; tools/imslog_merge.cpp merges shards back
+    // into one file by time stamp, so SetTimePrecision(6) is recommended. text and sync mode
+    // only. shards follow the date policies and the record count and level flush settings;
+    // flight recorder dumps and self reports still go to the regular file, which the merge
+    // takes as one more shard.
+    void SetSharded(bool sharded)
+    {
+        if (sharded && (mBinary || mQueue.get())) throw std::invalid_argument("sharded logs are for text and sync mode.");
+
+        mSharded = sharded;
+        mShardGeneration++;
+    }
+
+    void SetLogName(const std::string & logName)
+    {
+        if (logName.length() == 0)
+        {
+            throw std::invalid_argument("not a valid log file name.");
+        }
+
+        char * fname = NULL;
+        char full[MAX_PATH];
+        GetFullPathName(logName.c_str(), sizeof(full)/sizeof(full[0]), full, &fname);
+
+        mBaseName = fname;
+        char * dot = strrchr(fname, '.');
+        if (dot)
+        {
+            dot[0] = '\0';
+            mBaseName = fname;
+            dot[0] = '.';
+            if (dot[1]) mBaseExt = dot;
+        }
+        if (mPolicy == timestamped)
+        {
+            mBaseName = xs("%s.%ld", mBaseName.c_str(), (long)time(NULL)).s;
+        }
+
+        if (mBaseExt.length() == 0) mBaseExt = ".log";
+        mCheckedAt = -1;
+        mShardGeneration++;
+        fname[0] = '\x0';
+        mLogDir = full;
+
+        if (!CreateDirectory(mLogDir.c_str(), NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+        {
+            throw errno_error(xs("CreateDirectory('%s') failed: ", mLogDir.c_str()).s);
+        }
+
+        // printf("LogBaseName: %s%s\n", mBaseName.c_str(), mBaseExt.c_str());
+        // printf("LogDir: %s\n", mLogDir.c_str());
+    }
+
+private:
+    static void CrashHandler(int sig);
+
+    metrics MetricsLocked()
+    {
+        metrics m = mMetrics;
+        m.dropped = mDropped.load();
+        for (int i=0; i<metrics::latency_buckets; ++i) m.latency[i] = mLatency[i].load(std::memory_order_relaxed);
+        return m;
+    }
+
+    // times the scope into a log2 histogram; producers run concurrently, hence the atomics
+    struct latency_probe
+    {
+        latency_probe(std::atomic<uint64_t> * histogram) : mHistogram(histogram)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &mStart);
+        }
+
+        ~latency_probe()
+        {
+            timespec end;
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            uint64_t ns = (end.tv_sec - mStart.tv_sec) * 1000000000ull + end.tv_nsec - mStart.tv_nsec;
+            int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+            if (bucket >= metrics::latency_buckets) bucket = metrics::latency_buckets - 1;
+            mHistogram[bucket].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        std::atomic<uint64_t> * mHistogram;
+        timespec mStart;
+    };
+
+    // signal context: no mLock (the crashing thread may hold it), no stdio
+    void CrashDump()
+    {
+        log_file * f = mFile.get();
+        if (f == NULL || mRecordDepth == 0 || mBinary) return;
+
+        static const char begin[] = "---- flight recorder (crash) ----\n";
+        static const char end[] = "---- flight recorder end ----\n";
+        f->write_through(begin, sizeof(begin) - 1);
+        log_recorder::dump_unsafe(&logger::PutThrough, f, logSeverity__, LSV_MAX);
+        f->write_through(end, sizeof(end) - 1);
+    }
+
+    static void PutThrough(void * file, const char * line, size_t len)
+    {
+        ((log_file *)file)->write_through(line, len);
+    }
+
+    // close the active file as "<base>.<yyyymmdd-hhmmss><ext>", queue it for compression
+    // and drop the oldest segments; the next record reopens the active file.
+    void RotateSegment(time_t now)
+    {
+        // processes sharing the file all see it full; the first to rename it rotates, the rest follow
+        std::string active = xs("%s/%s", mLogDir.c_str(), mLogFile.c_str()).str();
+        if (mFile->shared() && !mFile->is(active.c_str()))
+        {
+            CloseFile();
+            mLogFile.clear();
+            mCheckedAt = -1;
+            return;
+        }
+
+        CloseFile();  // closing trims the preallocated tail
+
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        std::string suffix = mBaseExt + (mBinary ? IMSLOG_BINARY_SUFFIX : "");
+        xs stamp("%s.%d%02d%02d-%02d%02d%02d"
+            , mBaseName.c_str()
+            , tm.tm_year+1900
+            , tm.tm_mon+1
+            , tm.tm_mday
+            , tm.tm_hour
+            , tm.tm_min
+            , tm.tm_sec
+        );
+
+        // several rotations within a second get "-n" tie breakers, never reusing a name
+        mRotateSeq = now == mRotatedAt ? mRotateSeq + 1 : 0;
+        mRotatedAt = now;
+
+        std::string segment;
+        for (;; ++mRotateSeq)
+        {
+            segment = mRotateSeq == 0
+                ? xs("%s/%s%s", mLogDir.c_str(), stamp.s, suffix.c_str()).str()
+                : xs("%s/%s-%d%s", mLogDir.c_str(), stamp.s, mRotateSeq, suffix.c_str()).str();
+            if (access(segment.c_str(), F_OK) != 0 && access((segment + ".gz").c_str(), F_OK) != 0) break;
+        }
+
+        if (rename(active.c_str(), segment.c_str()) != 0)
+        {
+            mMetrics.writeErrors++;
+            fprintf(stderr, "cannot rename log file '%s': %s\n", active.c_str(), strerror(errno));
+        }
+        else
+        {
+            // the index keeps describing the segment, also once it is gunzipped again
+            rename((active + IMSLOG_INDEX_SUFFIX).c_str(), (segment + IMSLOG_INDEX_SUFFIX).c_str());
+            if (mCompressor.get()) mCompressor->push(segment);
+        }
+
+        mLogFile.clear();
+        mCheckedAt = -1;
+        mMetrics.rotations++;
+        PruneSegments(suffix);
+    }
+
+    // segment names sort by time, remove all but the newest mSegments - 1
+    void PruneSegments(const std::string & suffix)
+    {
+        scoped_ob<DIR *, dir_dtor> dir(opendir(mLogDir.c_str()));
+        if (dir.get() == NULL) return;
+
+        std::string prefix = mBaseName + ".";
+        std::vector<std::pair<std::string, std::string> > segments;
+        while (struct dirent * e = readdir(dir))
+        {
+            std::string name = e->d_name;
+            if (name.compare(0, prefix.length(), prefix) != 0) continue;
+
+            std::string rest = name.substr(prefix.length());
+            size_t digits = strspn(rest.c_str(), "0123456789-");
+            if (digits != 15 && (digits < 17 || rest[15] != '-')) continue;
+
+            std::string tail = rest.substr(digits);
+            if (tail != suffix && tail != suffix + ".gz") continue;
+
+            // "-n" tie breakers must sort after the plain stamp, and "-10" after "-9"
+            segments.push_back(std::make_pair(xs("%04d%s", (int)digits, rest.substr(0, digits).c_str()).str(), name));
+        }
+
+        std::sort(segments.begin(), segments.end());
+        std::string busy = mCompressor.get() ? mCompressor->busy() : "";
+        for (int i = 0; i + mSegments - 1 < (int)segments.size(); ++i)
+        {
+            std::string path = xs("%s/%s", mLogDir.c_str(), segments[i].second.c_str()).str();
+            if (path == busy) continue;
+
+            unlink(path.c_str());
+            size_t gz = path.length() - 3;
+            if (path.length() > 3 && path.compare(gz, 3, ".gz") == 0) path.erase(gz);
+            unlink((path + IMSLOG_INDEX_SUFFIX).c_str());
+        }
+    }
+
+    static int ParseLevel(const char * text)
+    {
+        static const char * names[] = { "DEBUG", "TRACE", "INFO", "WARNING", "ERROR", "FATAL", "UNKNOWN" };
+        for (int i=0; i<=LSV_MAX; ++i)
+        {
+            if (strcasecmp(text, names[i]) == 0) return i;
+        }
+
+        char * end = NULL;
+        long n = strtol(text, &end, 10);
+        return *text && *end == '\0' && n >= 0 && n <= LSV_MAX ? (int)n : -1;
+    }
+
+    static std::atomic<bool> & ReloadRequested()
+    {
+        static std::atomic<bool> requested__(false);
+        return requested__;
+    }
+
+    static void ReloadHandler(int)
+    {
+        ReloadRequested() = true;
+    }
+
+    // the directory is watched, editors and deployment tools tend to replace files.
+    // elsewhere the thread only waits for the signal.
+    void WatcherProc(std::string path)
+    {
+#ifdef __linux__
+        std::string dir = ".", base = path;
+        size_t slash = path.rfind('/');
+        if (slash != std::string::npos)
+        {
+            dir = slash ? path.substr(0, slash) : "/";
+            base = path.substr(slash + 1);
+        }
+
+        int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd >= 0 && inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+        {
+            fprintf(stderr, "cannot watch '%s': %s\n", dir.c_str(), strerror(errno));
+        }
+
+        char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+#else
+        int fd = -1;
+#endif
+        while (!mWatcherStopping)
+        {
+            bool reload = ReloadRequested().exchange(false);
+
+#ifdef __linux__
+            pollfd pfd = { fd, POLLIN, 0 };
+            if (fd >= 0 && poll(&pfd, 1, 200) > 0)
+            {
+                ssize_t n;
+                while ((n = read(fd, buff, sizeof(buff))) > 0)
+                {
+                    for (char * p = buff; p < buff + n; )
+                    {
+                        inotify_event * e = (inotify_event *)p;
+                        if (e->len && base == e->name) reload = true;
+                        p += sizeof(inotify_event) + e->len;
+                    }
+                }
+            }
+            else if (fd < 0)
+            {
+                usleep(200000);
+            }
+#else
+            usleep(200000);
+#endif
+
+            if (reload) LoadLevels(path);
+        }
+
+        if (fd >= 0) close(fd);
+    }
+
+    void StopWatcher()
+    {
+        if (!mWatcher.joinable()) return;
+
+        mWatcherStopping = true;
+        mWatcher.join();
+    }
+
+    struct shard
+    {
+        shard() : owner(NULL), generation(-1), checkedAt(-1), unflushed(0) {}
+
+        scoped_ptr <log_file, new_dtor<log_file> > file;
+        const logger * owner;
+        int generation;         // a shard of an older generation is reopened
+        std::string name;
+        std::string line;
+        time_t checkedAt;
+        int unflushed;
+    };
+
+    struct dir_dtor { void operator () (DIR * d) { if (d) closedir(d); } };
+
+    // WriteLine() for Log(), whose format was checked at the call site already
+    static void FormatTo(std::string & out, const char * format, ...)
+    {
+        va_list vl;
+        va_start(vl, format);
+        size_t n = 0;
+        const char * text = FormatV(n, format, vl);
+        va_end(vl);
+
+        // the summary is appended, a line end of the record itself would split it
+        if (n > 0 && text[n - 1] == '\n') --n;
+        out.assign(text, n);
+    }
+
+    void WriteFallback(int severity, const char * format, ...)
+    {
+        va_list vl;
+        va_start(vl, format);
+        WriteV(0, 1, severity, format, vl);
+        va_end(vl);
+    }
+
+    void RawFallback(int lineEnd, const char * format, ...)
+    {
+        va_list vl;
+        va_start(vl, format);
+        WriteV(1, lineEnd, 0, format, vl);
+        va_end(vl);
+    }
+
+    // the same for records a module let through, whatever the logger's level
+    void SubmitFallback(int severity, const char * format, ...)
+    {
+        va_list vl;
+        va_start(vl, format);
+        Submit(0, 1, severity, true, format, vl);
+        va_end(vl);
+    }
+
+    void RecordFallback(int severity, const char * format, ...)
+    {
+        va_list vl;
+        va_start(vl, format);
+        log_recorder::record(mRecordDepth, log_clock(mPrecision), severity, format, vl);
+        va_end(vl);
+    }
+
+    struct record
+    {
+        timespec time;
+        int severity;
+        char raw;
+        char lineEnd;
+        char lineFeed;
+        char toFile;
+        const log_site * site;  // binary record, message holds encoded arguments
+        size_t length;
+        char * spill;           // malloc()ed text of a record too long for message
+        char message[IMSLOG_RECORD_SIZE];
+    };
+
+    // a full queue blocks: a few turns for a cell to come free soon, then the producer sleeps
+    // until the writer frees one (the timeout only covers a wake up missed anyway)
+    record * Claim(int severity)
+    {
+        for (int turn = 0; ; ++turn)
+        {
+            record * r = mQueue->claim();
+            if (r != NULL) return r;
+
+            if (mOverflow == overflow_drop
+            || (mOverflow == overflow_drop_low && severity < LSV_WARNING))
+            {
+                mDropped++;
+                return NULL;
+            }
+
+            if (mWriterIdle.load(std::memory_order_relaxed)) WakeWriter();
+            if (turn < 64)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(mSpaceLock);
+            mSpaceWaiters++;
+            r = mQueue->claim();
+            if (r == NULL) mSpaceCond.wait_for(lock, std::chrono::milliseconds(10));
+            mSpaceWaiters--;
+            if (r != NULL) return r;
+        }
+    }
+
+    void WakeWriter()
+    {
+        std::lock_guard<std::mutex> lock(mIdleLock);
+        mWriterIdle = false;
+        mIdleCond.notify_one();
+    }
+
+    void WriterProc()
+    {
+        size_t reported = 0;
+        for (;;)
+        {
+            record * r = mQueue->front();
+            if (r != NULL)
+            {
+                if (r->site) EmitB(r->time, r->severity, *r->site, r->message, r->length);
+                else Emit(r->time, r->raw, r->lineEnd, r->severity, r->spill ? r->spill : r->message, r->lineFeed ? "\n" : "", r->toFile);
+                free(r->spill);
+                mQueue->pop();
+                mWritten = mQueue->popped();
+                if (mSpaceWaiters.load() != 0)
+                {
+                    std::lock_guard<std::mutex> lock(mSpaceLock);
+                    mSpaceCond.notify_one();
+                }
+                if (mFlushWaiters.load() != 0)
+                {
+                    std::lock_guard<std::mutex> lock(mIdleLock);
+                    mFlushCond.notify_all();
+                }
+                continue;
+            }
+
+            size_t dropped = mDropped.load();
+            if (dropped != reported)
+            {
+                Emit(log_clock(), 0, 1, LSV_WARNING
+                    , xs("%lu log records dropped: async queue full.", (unsigned long)(dropped - reported))
+                    , "\n");
+                reported = dropped;
+            }
+
+            std::unique_lock<std::mutex> lock(mIdleLock);
+            if (mStopping && mQueue->claimed() == mWritten) break;
+
+            // producers only take the lock to wake us when this flag is up
+            mWriterIdle = true;
+            if (mQueue->front() == NULL) mIdleCond.wait_for(lock, std::chrono::milliseconds(100));
+            mWriterIdle = false;
+        }
+    }
+
+    void FlusherProc()
+    {
+        std::unique_lock<std::mutex> lock(mFlusherLock);
+        while (!mFlusherStopping)
+        {
+            mFlusherCond.wait_for(lock, std::chrono::milliseconds(mFlushMillis));
+
+            CriticalSectionLocker cs(mLock);
+            _ims_lock(CriticalSectionLocker, cs)
+            {
+                if (mFile.get()) FlushFile();
+            }
+        }
+    }
+
+    void StopFlusher()
+    {
+        if (!mFlusher.joinable()) return;
+
+        {
+            std::lock_guard<std::mutex> lock(mFlusherLock);
+            mFlusherStopping = true;
+            mFlusherCond.notify_one();
+        }
+        mFlusher.join();
+    }
+
+    void StopWriter()
+    {
+        if (!mWriter.joinable()) return;
+
+        {
+            std::lock_guard<std::mutex> lock(mIdleLock);
+            mStopping = true;
+            mIdleCond.notify_one();
+        }
+        mWriter.join();
+        mFlushCond.notify_all();
+        mQueue = NULL;
+    }
+
+private:
+    scoped_ptr <log_file, new_dtor<log_file> > mFile;
+    log_file::kind mFileKind;
+    std::string mLine;
+    
+    std::string mBaseName;
+    std::string mBaseExt;
+    std::string mLogDir;
+    std::string mLogFile;
+    time_t mCheckedAt;
+    scoped_ptr <FILE, file_dtor> mIndex;
+    int mIndexEvery;
+    time_t mIndexedAt;
+    int mIndexCount;
+
+    rotation mPolicy;
+    int mSizeLimit;
+    int mSegments;
+    time_t mRotatedAt;
+    int mRotateSeq;
+    scoped_ptr <log_compressor, new_dtor<log_compressor> > mCompressor;
+    std::atomic<int> mLevel;    // atomic, as a level file reload may change it
+    int mPrecision;
+    bool mBinary;
+    std::atomic<int> mSinkLevel;    // lowest level of the sinks
+    std::atomic<int> mGateLevel;    // lowest of mLevel and mSinkLevel
+    std::vector<bool> mDefined;  // formats already defined in the current binary file
+    int mRecordLevel;
+    int mRecordDepth;
+
+    // self metrics; mMetrics is guarded by mLock
+    metrics mMetrics;
+    std::atomic<uint64_t> mLatency[metrics::latency_buckets];
+    int mReportEvery;
+    time_t mReportAt;
+
+    // durability
+    int mFlushEvery;
+    int mFlushMillis;
+    int mFlushLevel;
+    bool mSyncOnRotate;
+    int mUnflushed;
+    int64_t mFlushedAt;
+    file_stats mFileStats;
+    bool mFlusherStopping;
+    std::thread mFlusher;
+    std::mutex mFlusherLock;
+    std::condition_variable mFlusherCond;
+
+    bool mSharded;
+    std::atomic<int> mShardGeneration;
+
+    // modules; the deque keeps references to them valid
+    std::deque<log_module> mModules;
+    std::map<std::string, int> mModuleLevels;
+    std::mutex mModulesLock;
+    std::thread mWatcher;
+    std::atomic<bool> mWatcherStopping;
+
+    CRITICAL_SECTION mLock;
+    std::vector<log_sink *> mSinks;
+    console_sink * mConsole;
+
+    // async mode
+    scoped_ptr <mpsc_ring<record>, new_dtor<mpsc_ring<record> > > mQueue;
+    overflow mOverflow;
+    std::atomic<size_t> mDropped;
+    std::atomic<size_t> mWritten;
+    std::atomic<int> mFlushWaiters;
+    bool mStopping;
+    std::atomic<bool> mWriterIdle;
+    std::thread mWriter;
+    std::mutex mIdleLock;
+    std::condition_variable mIdleCond;
+    std::condition_variable mFlushCond;
+    std::atomic<int> mSpaceWaiters;     // producers asleep on a full queue
+    std::mutex mSpaceLock;
+    std::condition_variable mSpaceCond;
+};
+
+#ifndef _WIN32
 inline void SetConsoleTextAttribute(HANDLE console, CONSOLE_ATTRIBUTE attr)
 {
     fprintf(console, "\033[%sm", attr);
@@ -375,6 +1971,12 @@ inline void SetConsoleTextAttribute(HANDLE console, CONSOLE_ATTRIBUTE attr)
 #endif//!_WIN32
 
 extern logger & logger__;
+
+inline void logger::CrashHandler(int sig)
+{
+    logger__.CrashDump();
+    raise(sig);
+}
 template<int N=1024>
 struct logutil
 {
@@ -385,6 +1987,7 @@ struct logutil
     {
     }
 
+    IMSLOG_PRINTF(2, 3)
     void operator () (const char * format, ...)
     {
         va_list vl;
@@ -398,15 +2001,133 @@ struct logutil
     bool mRawOutput;
 };
 
-#define LOGENDL	    do {logger__.WriteRaw(1, "");} while(0)
+// per call site limit for the LOGx_RATE macros: at most `perSecond` records in a second.
+// a few relaxed atomics, no lock; the window is the wall clock second.
+struct log_rate_limit
+{
+    explicit log_rate_limit(int perSecond)
+        : mLimit(perSecond)
+        , mSecond(0)
+        , mCount(0)
+        , mSuppressed(0)
+    {
+    }
+
+    // false when the record is to be dropped; otherwise skipped is what was dropped since the last one
+    bool admit(unsigned & skipped)
+    {
+        int64_t now = log_clock().tv_sec;
+        int64_t second = mSecond.load(std::memory_order_relaxed);
+        if (second != now && mSecond.compare_exchange_strong(second, now, std::memory_order_relaxed))
+        {
+            mCount.store(0, std::memory_order_relaxed);
+        }
+
+        if (mCount.fetch_add(1, std::memory_order_relaxed) >= mLimit)
+        {
+            mSuppressed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        skipped = mSuppressed.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    int mLimit;
+    std::atomic<int64_t> mSecond;
+    std::atomic<int> mCount;
+    std::atomic<unsigned> mSuppressed;
+};
+
+// per call site sampling for the LOGx_SAMPLE macros: one record out of every `every`.
+struct log_sampler
+{
+    explicit log_sampler(unsigned every) : mEvery(every ? every : 1), mCount(0) {}
+
+    bool admit(unsigned & skipped)
+    {
+        unsigned n = mCount.fetch_add(1, std::memory_order_relaxed);
+        if (n % mEvery) return false;
+
+        skipped = n ? mEvery - 1 : 0;
+        return true;
+    }
+
+    unsigned mEvery;
+    std::atomic<unsigned> mCount;
+};
+
+// never called, only lets the compiler check a LOGx format against its arguments
+inline void IMSLOG_PRINTF(1, 2) imslog_check_format(const char *, ...) {}
+
+// each statement owns a static log_site, which gives its format a stable id for binary mode.
+// the severity is tested first, so arguments of a disabled statement are never evaluated,
+// and statements below IMSLOG_MIN_LEVEL fold away at compile time.
+#define IMSLOG_FORMAT_(format, ...) format
+#define IMSLOG_(severity, ...) do { \
+    if ((severity) >= IMSLOG_MIN_LEVEL && logger__.Enabled(severity)) { \
+        static const log_site site__(IMSLOG_FORMAT_(__VA_ARGS__, 0)); \
+        logger__.Log(site__, severity, __VA_ARGS__); \
+    } \
+    if (0) imslog_check_format(__VA_ARGS__); \
+} while (0)
+
+// the limiter is static per statement as well and is consulted before the arguments are evaluated
+#define IMSLOG_LIMITED_(severity, limiter, limit, ...) do { \
+    if ((severity) >= IMSLOG_MIN_LEVEL && logger__.Enabled(severity)) { \
+        static limiter limit__(limit); \
+        unsigned skipped__ = 0; \
+        if (limit__.admit(skipped__)) { \
+            static const log_site site__(IMSLOG_FORMAT_(__VA_ARGS__, 0)); \
+            logger__.LogLimited(site__, severity, skipped__, __VA_ARGS__); \
+        } \
+    } \
+    if (0) imslog_check_format(__VA_ARGS__); \
+} while (0)
+
+#define LOG_RATE(severity, perSecond, ...)  IMSLOG_LIMITED_(severity, log_rate_limit, perSecond, __VA_ARGS__)
+#define LOG_SAMPLE(severity, every, ...)    IMSLOG_LIMITED_(severity, log_sampler, every, __VA_ARGS__)
+
+// a module for the MLOGx macros, looked up once per scope:
+//   IMSLOG_MODULE(net__, "net"); ... MLOGD(net__, "peer %s", name);
+#define IMSLOG_MODULE(var, name) static log_module & var = logger__.Module(name)
+
+#define MLOG_(module, severity, ...) do { \
+    if ((severity) >= IMSLOG_MIN_LEVEL && logger__.Enabled(module, severity)) { \
+        static const log_site site__(IMSLOG_FORMAT_(__VA_ARGS__, 0)); \
+        logger__.LogModule(module, site__, severity, __VA_ARGS__); \
+    } \
+    if (0) imslog_check_format(__VA_ARGS__); \
+} while (0)
+
+#define LOGENDL	    do {logger__.EndLine();} while(0)
 #define LOGX		logutil
-#define TRACE		logutil()
-#define LOGD        logutil(LSV_DEBUG)
-#define LOGT        logutil(LSV_TRACE)
-#define LOGI		logutil(LSV_INFO)
-#define LOGW		logutil(LSV_WARNING)
-#define LOGE		logutil(LSV_ERROR)
-#define LOGF		logutil(LSV_FATAL)
-#define LOGU		logutil(LSV_UNKNOWN)
+#define TRACE(...)  IMSLOG_(LSV_TRACE,   __VA_ARGS__)
+#define LOGD(...)   IMSLOG_(LSV_DEBUG,   __VA_ARGS__)
+#define LOGT(...)   IMSLOG_(LSV_TRACE,   __VA_ARGS__)
+#define LOGI(...)   IMSLOG_(LSV_INFO,    __VA_ARGS__)
+#define LOGW(...)   IMSLOG_(LSV_WARNING, __VA_ARGS__)
+#define LOGE(...)   IMSLOG_(LSV_ERROR,   __VA_ARGS__)
+#define LOGF(...)   IMSLOG_(LSV_FATAL,   __VA_ARGS__)
+#define LOGU(...)   IMSLOG_(LSV_UNKNOWN, __VA_ARGS__)
+
+#define MLOGD(m, ...) MLOG_(m, LSV_DEBUG,   __VA_ARGS__)
+#define MLOGT(m, ...) MLOG_(m, LSV_TRACE,   __VA_ARGS__)
+#define MLOGI(m, ...) MLOG_(m, LSV_INFO,    __VA_ARGS__)
+#define MLOGW(m, ...) MLOG_(m, LSV_WARNING, __VA_ARGS__)
+#define MLOGE(m, ...) MLOG_(m, LSV_ERROR,   __VA_ARGS__)
+#define MLOGF(m, ...) MLOG_(m, LSV_FATAL,   __VA_ARGS__)
+
+#define LOGD_RATE(n, ...)   LOG_RATE(LSV_DEBUG,   n, __VA_ARGS__)
+#define LOGT_RATE(n, ...)   LOG_RATE(LSV_TRACE,   n, __VA_ARGS__)
+#define LOGI_RATE(n, ...)   LOG_RATE(LSV_INFO,    n, __VA_ARGS__)
+#define LOGW_RATE(n, ...)   LOG_RATE(LSV_WARNING, n, __VA_ARGS__)
+#define LOGE_RATE(n, ...)   LOG_RATE(LSV_ERROR,   n, __VA_ARGS__)
+
+#define LOGD_SAMPLE(n, ...) LOG_SAMPLE(LSV_DEBUG,   n, __VA_ARGS__)
+#define LOGT_SAMPLE(n, ...) LOG_SAMPLE(LSV_TRACE,   n, __VA_ARGS__)
+#define LOGI_SAMPLE(n, ...) LOG_SAMPLE(LSV_INFO,    n, __VA_ARGS__)
+#define LOGW_SAMPLE(n, ...) LOG_SAMPLE(LSV_WARNING, n, __VA_ARGS__)
+#define LOGE_SAMPLE(n, ...) LOG_SAMPLE(LSV_ERROR,   n, __VA_ARGS__)
 
 #endif//OPADMIN_LOG_H_INCLUDED__
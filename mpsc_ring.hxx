@@ -0,0 +1,130 @@
+/*********************************************************************************
+File name:	mpsc_ring.hxx
+Description:
+			bounded lock-free ring, many producers & one consumer
+
+			each cell carries a sequence number (D. Vyukov's bounded queue),
+			producers claim a cell with one CAS, fill it in place and commit;
+			the consumer reads cells strictly in claim order.
+**********************************************************************************/
+
+#ifndef __IMSLIB_MPSCRING_HPP_UX
+#define __IMSLIB_MPSCRING_HPP_UX
+
+#ifndef __cplusplus
+#error This file need a C++ compiler.
+#endif//__cplusplus
+
+#if (_MSC_VER >= 800)
+#pragma once
+#endif
+
+#include <stddef.h>
+#include <atomic>
+#include <stdexcept>
+
+namespace imsux {
+
+template <class T>
+class mpsc_ring
+{
+	struct cell
+	{
+		std::atomic<size_t> seq;
+		T data;
+	};
+
+public:
+	mpsc_ring(size_t capacity) : m_cells(NULL), m_mask(0), m_head(0), m_tail(0)
+	{
+		if (capacity < 2) throw std::invalid_argument("ring capacity too small.");
+
+		size_t n = 2;
+		while (n < capacity) n += n;
+
+		m_cells = new cell [n];
+		m_mask = n - 1;
+		for (size_t i=0; i<n; ++i) m_cells[i].seq.store(i, std::memory_order_relaxed);
+	}
+
+	~mpsc_ring()
+	{
+		delete [] m_cells;
+	}
+
+	size_t capacity() const { return m_mask + 1; }
+
+	// total number of cells ever claimed, usable as a ticket for barriers.
+	size_t claimed() const { return m_tail.load(std::memory_order_acquire); }
+
+	// producer side: returns NULL when the ring is full.
+	// a claimed cell must be commit()-ed, the consumer stalls on it until then.
+	T * claim()
+	{
+		size_t pos = m_tail.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			cell & c = m_cells[pos & m_mask];
+			size_t seq = c.seq.load(std::memory_order_acquire);
+			ptrdiff_t dif = (ptrdiff_t)seq - (ptrdiff_t)pos;
+
+			if (dif == 0)
+			{
+				if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) return &c.data;
+			}
+			else if (dif < 0)
+			{
+				return NULL;
+			}
+			else
+			{
+				pos = m_tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	void commit(T * t)
+	{
+		cell * c = cell_of(t);
+		c->seq.store(c->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// consumer side: next committed cell in claim order, NULL if none yet.
+	T * front()
+	{
+		cell & c = m_cells[m_head & m_mask];
+		size_t seq = c.seq.load(std::memory_order_acquire);
+
+		return seq == m_head + 1 ? &c.data : NULL;
+	}
+
+	void pop()
+	{
+		cell & c = m_cells[m_head & m_mask];
+		c.seq.store(m_head + m_mask + 1, std::memory_order_release);
+		++m_head;
+	}
+
+	// number of cells consumed so far, only meaningful on the consumer thread.
+	size_t popped() const { return m_head; }
+
+private:
+	mpsc_ring(const mpsc_ring &);
+	mpsc_ring & operator = (const mpsc_ring &);
+
+	cell * cell_of(T * t)
+	{
+		size_t i = ((char *)t - (char *)&m_cells[0].data) / sizeof(cell);
+		return m_cells + i;
+	}
+
+	cell * m_cells;
+	size_t m_mask;
+	size_t m_head;
+	char m_pad[64];
+	std::atomic<size_t> m_tail;
+};
+
+} // namespace imsux
+
+#endif//__IMSLIB_MPSCRING_HPP_UX
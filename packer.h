@@ -21,7 +21,21 @@ History:
 #ifndef IECAS_PACKER_H_INCLUDED__
 #define IECAS_PACKER_H_INCLUDED__
 
+#include <type_traits>
+#include <vector>
 #include "utf8_conv.h"
+// the std::string_view pops need C++17, the rest builds as C++11
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#define IMSUX_PACKER_STRING_VIEW 1
+#include <string_view>
+#endif
+#if defined(_MSC_VER)
+#include <stdlib.h>
+#endif
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define IMSUX_PACKER_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 namespace imsux {
 
@@ -84,6 +98,180 @@ private:
 	int32_t m_buffer_len;
 };
 
+// non-owning view of bytes inside a packer buffer; valid until the packer is changed or destroyed
+class blob_view
+{
+public:
+	blob_view() : m_buffer(NULL), m_buffer_len(0) {}
+	blob_view(const byte * buffer, int32_t len) : m_buffer(buffer), m_buffer_len(len) {}
+
+	const byte * buffer() const { return m_buffer; };
+	int32_t length() const { return m_buffer_len; };
+
+private:
+	const byte * m_buffer;
+	int32_t m_buffer_len;
+};
+
+// byte order of the host, known at compile time
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define IMSUX_HOST_BIG_ENDIAN 1
+#else
+#define IMSUX_HOST_BIG_ENDIAN 0		// no compiler macro: windows and the rest are little endian
+#endif
+
+class byte_order
+{
+public:
+	static uint8_t  swap(uint8_t  v) { return v; }
+#if defined(_MSC_VER)
+	static uint16_t swap(uint16_t v) { return _byteswap_ushort(v); }
+	static uint32_t swap(uint32_t v) { return _byteswap_ulong(v); }
+	static uint64_t swap(uint64_t v) { return _byteswap_uint64(v); }
+#else
+	static uint16_t swap(uint16_t v) { return __builtin_bswap16(v); }
+	static uint32_t swap(uint32_t v) { return __builtin_bswap32(v); }
+	static uint64_t swap(uint64_t v) { return __builtin_bswap64(v); }
+#endif
+
+	// any 1, 2, 4 or 8 byte value, floats included
+	template <class T>
+	static T reverse(T v)
+	{
+		typedef typename unsigned_of<sizeof(T)>::type U;
+
+		U u;
+		memcpy(&u, &v, sizeof(T));
+		u = swap(u);
+		memcpy(&v, &u, sizeof(T));
+
+		return v;
+	}
+
+	// count values of width bytes each, from src to dst reversed; dst may be src.
+	// uses the widest shuffles the cpu has, checked once.
+	static void reverse_array(byte * dst, const byte * src, size_t count, int width)
+	{
+		static const array_kernel kernel = select_kernel();
+
+		if (width == 1)
+		{
+			if (dst != src) memmove(dst, src, count);
+			return;
+		}
+		kernel(dst, src, count, width);
+	}
+
+	typedef void (* array_kernel)(byte * dst, const byte * src, size_t count, int width);
+
+	static void reverse_array_scalar(byte * dst, const byte * src, size_t count, int width)
+	{
+		for (size_t i=0; i<count; ++i, dst += width, src += width)
+		{
+			if (width == 2) reverse_at<uint16_t>(dst, src);
+			else if (width == 4) reverse_at<uint32_t>(dst, src);
+			else reverse_at<uint64_t>(dst, src);
+		}
+	}
+
+#ifdef IMSUX_PACKER_X86_SIMD
+	__attribute__((target("ssse3")))
+	static void reverse_array_ssse3(byte * dst, const byte * src, size_t count, int width)
+	{
+		const __m128i mask = _mm_loadu_si128((const __m128i *)shuffle_mask(width));
+		size_t bytes = count * width, i = 0;
+
+		for (; i + 16 <= bytes; i += 16)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, mask));
+		}
+		reverse_array_scalar(dst + i, src + i, (bytes - i) / width, width);
+	}
+
+	// vpshufb shuffles each 16 byte lane on its own, which is fine as values never cross one
+	__attribute__((target("avx2")))
+	static void reverse_array_avx2(byte * dst, const byte * src, size_t count, int width)
+	{
+		const __m256i mask = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)shuffle_mask(width)));
+		size_t bytes = count * width, i = 0;
+
+		for (; i + 32 <= bytes; i += 32)
+		{
+			__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+			_mm256_storeu_si256((__m256i *)(dst + i), _mm256_shuffle_epi8(v, mask));
+		}
+		reverse_array_scalar(dst + i, src + i, (bytes - i) / width, width);
+	}
+#endif
+
+private:
+	template <int N> struct unsigned_of;
+
+	template <class U>
+	static void reverse_at(byte * dst, const byte * src)
+	{
+		U u;
+		memcpy(&u, src, sizeof(U));
+		u = swap(u);
+		memcpy(dst, &u, sizeof(U));
+	}
+
+#ifdef IMSUX_PACKER_X86_SIMD
+	// pshufb control reversing every value of 16 bytes
+	static const byte * shuffle_mask(int width)
+	{
+		static const byte masks[3][16] = {
+			{ 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14 },
+			{ 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 },
+			{ 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8 },
+		};
+		return masks[width == 2 ? 0 : width == 4 ? 1 : 2];
+	}
+#endif
+
+	static array_kernel select_kernel()
+	{
+#ifdef IMSUX_PACKER_X86_SIMD
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) return reverse_array_avx2;
+		if (__builtin_cpu_supports("ssse3")) return reverse_array_ssse3;
+#endif
+		return reverse_array_scalar;
+	}
+};
+
+template <> struct byte_order::unsigned_of<1> { typedef uint8_t  type; };
+template <> struct byte_order::unsigned_of<2> { typedef uint16_t type; };
+template <> struct byte_order::unsigned_of<4> { typedef uint32_t type; };
+template <> struct byte_order::unsigned_of<8> { typedef uint64_t type; };
+
+// byte order policies of basic_packer: convert() turns a host value into the packed one and back
+// and convert_array() does so for count values of width bytes, dst may be src.
+struct big_endian_order
+{
+	template <class T>
+	static T convert(T v) { return IMSUX_HOST_BIG_ENDIAN ? v : byte_order::reverse(v); }
+
+	static void convert_array(byte * dst, const byte * src, size_t count, int width)
+	{
+		if (IMSUX_HOST_BIG_ENDIAN) { if (dst != src) memmove(dst, src, count * width); }
+		else byte_order::reverse_array(dst, src, count, width);
+	}
+};
+
+struct little_endian_order
+{
+	template <class T>
+	static T convert(T v) { return IMSUX_HOST_BIG_ENDIAN ? byte_order::reverse(v) : v; }
+
+	static void convert_array(byte * dst, const byte * src, size_t count, int width)
+	{
+		if (IMSUX_HOST_BIG_ENDIAN) byte_order::reverse_array(dst, src, count, width);
+		else if (dst != src) memmove(dst, src, count * width);
+	}
+};
+
 class value_packer
 {
 public:
@@ -180,115 +368,243 @@ public:
 	template <class T>
 	static T convert_endian(T v)
 	{
-		static bool host_is_le = is_host_le();
+		return big_endian_order::convert(v);
+	}
+
+	static bool is_host_le()
+	{
+		int32_t v = 0x1;
+		char * p = (char *)&v;
+
+		return p[0] ? true : false;
+	}
+};
+
+// where packers get their buffers. allocate() may hand out more than len bytes and says so in
+// len; buffers are not zeroed, a packer only reads what it has written.
+class packer_allocator
+{
+public:
+	virtual ~packer_allocator() {}
 
-		if (host_is_le)
+	virtual byte * allocate(int32_t & len) = 0;
+	virtual void deallocate(byte * buffer, int32_t len) = 0;
+};
+
+// keeps released buffers for reuse, a few of each power of two size up to max_pooled.
+// not thread safe: each thread has its own, see local(), which is what packers use by default.
+class packer_buffer_pool : public packer_allocator
+{
+public:
+	enum { min_size = 64, max_pooled = 1 << 20, per_size = 8 };
+
+	~packer_buffer_pool()
+	{
+		for (int i=0; i<(int)(sizeof(m_free) / sizeof(m_free[0])); ++i)
 		{
-			T v2;
+			for (size_t j=0; j<m_free[i].size(); ++j) delete [] m_free[i][j];
+		}
+	}
 
-			byte * p1 = (byte *)&v;
-			byte * p2 = (byte *)&v2;
+	virtual byte * allocate(int32_t & len)
+	{
+		if (len > max_pooled) return new byte [len];
+
+		int c = size_class(len);
+		len = min_size << c;
+		if (m_free[c].empty()) return new byte [len];
 
-			for (int i=0; i<(int)sizeof(T); ++i)
-			{
-				p2 [(int)sizeof(T) - i - 1] = p1[i];
-			}
+		byte * buffer = m_free[c].back();
+		m_free[c].pop_back();
+		return buffer;
+	}
 
-			return v2;
+	virtual void deallocate(byte * buffer, int32_t len)
+	{
+		if (len > max_pooled)
+		{
+			delete [] buffer;
+			return;
 		}
-		else
+
+		int c = size_class(len);
+		if ((min_size << c) != len || m_free[c].size() >= per_size)
 		{
-			return v;
+			delete [] buffer;
+			return;
 		}
+		m_free[c].push_back(buffer);
 	}
 
-	static bool is_host_le()
+	// this thread's pool; NULL while the thread is exiting and the pool is gone
+	static packer_buffer_pool * local()
 	{
-		int32_t v = 0x1;
-		char * p = (char *)&v;
+		static thread_local bool gone = false;
+		struct holder
+		{
+			~holder() { gone = true; }
+			packer_buffer_pool pool;
+		};
 
-		return p[0] ? true : false;
+		if (gone) return NULL;
+
+		static thread_local holder h;
+		return &h.pool;
 	}
+
+private:
+	// smallest c with min_size << c >= len, for len up to max_pooled
+	static int size_class(int32_t len)
+	{
+		int c = 0;
+		while ((min_size << c) < len) ++c;
+		return c;
+	}
+
+	std::vector<byte *> m_free[15];		// min_size << 14 == max_pooled
 };
 
-class binary_packer : public value_packer
+// hands out pieces of one caller supplied block, for packers that live no longer than the
+// block. nothing is freed piece by piece except the last one given out, reset() makes all of
+// the block available again.
+class packer_arena : public packer_allocator
 {
 public:
+	packer_arena(void * memory, size_t size)
+		: m_memory((byte *)memory)
+		, m_size(size)
+		, m_used(0)
+		, m_last(0)
+	{
+		if (!memory) throw std::invalid_argument("invalid arena memory.");
+	}
+
+	virtual byte * allocate(int32_t & len)
+	{
+		size_t start = (m_used + 15) & ~(size_t)15;
+		if (len < 0 || start > m_size || (size_t)len > m_size - start) throw std::length_error("packer arena exhausted.");
+
+		m_last = m_used;
+		m_used = start + len;
+		return m_memory + start;
+	}
+
+	virtual void deallocate(byte * buffer, int32_t len)
+	{
+		if (buffer + len == m_memory + m_used) m_used = m_last;
+	}
+
+	void reset() { m_used = m_last = 0; }
+	size_t used() const { return m_used; }
+
+private:
+	byte * m_memory;
+	size_t m_size;
+	size_t m_used;
+	size_t m_last;		// m_used before the last allocation
+};
+
+// the packer without virtual calls: same format and behavior as binary_packer, which wraps
+// basic_packer<big_endian_order>. use it directly where the packer type is known, a run of
+// pushes then compiles to plain stores.
+template <class Order = big_endian_order>
+class basic_packer
+{
+public:
+	typedef Order order_type;
+
 	static int32_t & default_buffer_len()
 	{
 		static int len_ = 1024;
 		return len_;
 	};
 
-	binary_packer(int32_t init_buffer = 0, const char * charset = "")
-		: m_buffer_doclean(true)
+	// buffers come from allocator, this thread's packer_buffer_pool when it is NULL
+	basic_packer(int32_t init_buffer = 0, const char * charset = "", packer_allocator * allocator = NULL)
+		: m_conv(charset)
+		, m_charset(charset)
+		, m_buffer_doclean(true)
 		, m_buffer(NULL)
 		, m_buffer_len(init_buffer)
 		, m_buffer_occupied(0)
 		, m_popped(0)
-		, m_charset(charset)
-		, m_conv(charset)
+		, m_allocator(allocator)
 	{
 		if (m_buffer_len < 0) throw std::invalid_argument("invalid buffer length.");
 		if (m_buffer_len == 0) m_buffer_len = default_buffer_len();
 
-		m_buffer = new byte [m_buffer_len];
-		memset(m_buffer, 0, m_buffer_len);
+		m_buffer = allocate_buffer(m_buffer_len);
+
+		m_utf8 = m_conv.is_utf8();
 	}
 
-	virtual ~binary_packer()
+	~basic_packer()
 	{
-		if (m_buffer_doclean) delete [] m_buffer;
+		if (m_buffer_doclean) release_buffer(m_buffer, m_buffer_len);
 	}
 
+private:
+	basic_packer(const basic_packer &);
+	basic_packer & operator = (const basic_packer &);
+
 public:
 	// access interfaces
-	virtual void * buffer() { return m_buffer; }
-	virtual int32_t length() const { return m_buffer_occupied; }
-	virtual void bind(byte * buffer, int32_t buffer_len)
+	void * buffer() { return m_buffer; }
+	const void * buffer() const { return m_buffer; }
+	int32_t length() const { return m_buffer_occupied; }
+	void bind(byte * buffer, int32_t buffer_len)
 	{
 		if (!buffer || buffer_len <= 0) throw std::invalid_argument("empty buffer or invalid buffer length");
 
-		delete [] m_buffer;
+		if (m_buffer_doclean) release_buffer(m_buffer, m_buffer_len);
 
 		m_buffer_doclean = false;
 		m_buffer = buffer;
 		m_buffer_len = m_buffer_occupied = buffer_len;
 	}
-	virtual void reset()
+	void reset()
 	{
-		memset(m_buffer, 0, m_buffer_len);
 		m_buffer_occupied = 0;
 	}
 
 	// push interfaces
-	virtual void push_int8 (int8_t  v) { pack_single_value(v); }
-	virtual void push_int16(int16_t v) { pack_single_value(v); }
-	virtual void push_int32(int32_t v) { pack_single_value(v); }
-	virtual void push_int64(int64_t v) { pack_single_value(v); }
-	virtual void push_float(float   v) { pack_single_value(v); }
-	virtual void push_double(double v) { pack_single_value(v); }
-
-	virtual void push_uint8 (uint8_t  v) { push_int8 ((int8_t )v); }
-	virtual void push_uint16(uint16_t v) { push_int16((int16_t)v); }
-	virtual void push_uint32(uint32_t v) { push_int32((int32_t)v); }
-	virtual void push_uint64(uint64_t v) { push_int64((int64_t)v); }
-
-	using value_packer::push_string;
-	virtual void push_string(const char * v, int32_t n = -1)
+	void push_int8 (int8_t  v) { pack_single_value(v); }
+	void push_int16(int16_t v) { pack_single_value(v); }
+	void push_int32(int32_t v) { pack_single_value(v); }
+	void push_int64(int64_t v) { pack_single_value(v); }
+	void push_float(float   v) { pack_single_value(v); }
+	void push_double(double v) { pack_single_value(v); }
+
+	void push_uint8 (uint8_t  v) { pack_single_value(v); }
+	void push_uint16(uint16_t v) { pack_single_value(v); }
+	void push_uint32(uint32_t v) { pack_single_value(v); }
+	void push_uint64(uint64_t v) { pack_single_value(v); }
+
+	void push_string(const char * v, int32_t n = -1)
 	{
 		if (n < -1) throw std::invalid_argument("invalid string length.");
 		if (!v) throw std::invalid_argument("null string specified.");
 
 		int32_t len = (n == -1) ? (int)strlen(v) : n;
+		if (m_utf8)
+		{
+			push_int32(len);
+			push_raw(v, len);
+			return;
+		}
+
 		std::string utf8 = m_conv.to_utf8(v, len);
 
 		len = (int)utf8.length();
 		push_int32(len);
 		push_raw(utf8.c_str(), len);
 	}
+	void push_string(const std::string & s)
+	{
+		push_string(s.c_str(), (int)s.length());
+	}
 
-	virtual void push_binary(const void * v, int32_t n)
+	void push_binary(const void * v, int32_t n)
 	{
 		if (!v) throw std::invalid_argument("invalid address.");
 		if (n < 0) throw std::invalid_argument("invalid buffer length.");
@@ -296,8 +612,12 @@ public:
 		push_int32(n);
 		push_raw(v, n);
 	}
+	void push_binary(const blob & b)
+	{
+		push_binary(b.buffer(), b.length());
+	}
 
-	virtual void push_raw(const void * v, int32_t n)
+	void push_raw(const void * v, int32_t n)
 	{
 		if (!v) throw std::invalid_argument("invalid address.");
 		if (n < 0) throw std::invalid_argument("invalid buffer length.");
@@ -306,42 +626,72 @@ public:
 		memcpy(m_buffer + m_buffer_occupied, v, n);
 		m_buffer_occupied += n;
 	}
+	void push_raw(const blob & b)
+	{
+		push_raw(b.buffer(), b.length());
+	}
+
+	// n values packed one after the other, the same bytes as n push_xxx() calls.
+	// T is any integer or floating point type of 1, 2, 4 or 8 bytes.
+	template <class T>
+	void push_array(const T * v, int32_t n)
+	{
+		static_assert(std::is_arithmetic<T>::value && (sizeof(T) & (sizeof(T) - 1)) == 0 && sizeof(T) <= 8, "not a packable value type");
+
+		if (!v && n) throw std::invalid_argument("invalid address.");
+		if (n < 0) throw std::invalid_argument("invalid array length.");
+		if ((int64_t)n * (int)sizeof(T) > 0x7fffffff - m_buffer_occupied) throw std::length_error("array too long.");
+
+		ensure_buffer_enough((size_t)n * sizeof(T));
+		Order::convert_array(m_buffer + m_buffer_occupied, (const byte *)v, n, (int)sizeof(T));
+		m_buffer_occupied += n * (int)sizeof(T);
+	}
+
+	// n bytes added at the end for the caller to fill, in Order like the rest
+	byte * push_space(int32_t n)
+	{
+		if (n < 0) throw std::invalid_argument("invalid buffer length.");
+
+		ensure_buffer_enough(n);
+		m_buffer_occupied += n;
+		return m_buffer + m_buffer_occupied - n;
+	}
 
 	// pop interfaces
-	virtual void pop_reset(int32_t pos = 0)
+	void pop_reset(int32_t pos = 0)
 	{
 		if (pos < 0 || pos > m_buffer_occupied) throw std::invalid_argument("invalid pop position.");
 
 		m_popped = pos;
 	}
+	int32_t pop_position() const { return m_popped; }
 
-	// MSVC 6.0 does not support this: T Foo::Get<T>()... -_-!
-	virtual int8_t  pop_int8 () { return unpack_single_value(int8_t ()); }
-	virtual int16_t pop_int16() { return unpack_single_value(int16_t()); }
-	virtual int32_t pop_int32() { return unpack_single_value(int32_t()); }
-	virtual int64_t pop_int64() { return unpack_single_value(int64_t()); }
-	virtual float   pop_float() { return unpack_single_value(float  ()); }
-	virtual double  pop_double(){ return unpack_single_value(double ()); }
-
-	virtual uint8_t  pop_uint8 () { return (uint8_t )pop_int8 (); }
-	virtual uint16_t pop_uint16() { return (uint16_t)pop_int16(); }
-	virtual uint32_t pop_uint32() { return (uint32_t)pop_int32(); }
-	virtual uint64_t pop_uint64() { return (uint64_t)pop_int64(); }
+	// the conversion push_string() and pop_string() do, NULL when the charset is UTF-8
+	const utf8_conv * string_conv() const { return m_utf8 ? NULL : &m_conv; }
 
-	virtual std::string pop_string()
-	{
-		int32_t len = pop_int32();
+	int8_t  pop_int8 () { return unpack_single_value<int8_t >(); }
+	int16_t pop_int16() { return unpack_single_value<int16_t>(); }
+	int32_t pop_int32() { return unpack_single_value<int32_t>(); }
+	int64_t pop_int64() { return unpack_single_value<int64_t>(); }
+	float   pop_float() { return unpack_single_value<float  >(); }
+	double  pop_double(){ return unpack_single_value<double >(); }
 
-		if (m_popped + len > m_buffer_occupied) throw std::out_of_range("no more content");
+	uint8_t  pop_uint8 () { return unpack_single_value<uint8_t >(); }
+	uint16_t pop_uint16() { return unpack_single_value<uint16_t>(); }
+	uint32_t pop_uint32() { return unpack_single_value<uint32_t>(); }
+	uint64_t pop_uint64() { return unpack_single_value<uint64_t>(); }
 
-		int32_t popped = m_popped;
-		m_popped += len;
+	std::string pop_string()
+	{
+		blob_view utf8 = pop_binary_view();
+		if (m_utf8) return std::string((const char *)utf8.buffer(), utf8.length());
 
-		std::string utf8((const char *)m_buffer + popped, len);
-		return m_conv.from_utf8(utf8.c_str(), (int)utf8.length());
+		return m_conv.from_utf8((const char *)utf8.buffer(), utf8.length());
 	}
 
-	virtual int32_t pop_string(char * v, int32_t n)
+	// when v is NULL, return length needed, and pop cursor is not advanced.
+	// when v is not NULL but n is not enough, string will be truncated, and the pop cursor will be advanced.
+	int32_t pop_string(char * v, int32_t n)
 	{
 		if (v == NULL)
 		{
@@ -354,6 +704,17 @@ public:
 
 		if (n <= 0) throw std::invalid_argument("string buffer length not valid.");
 
+		if (m_utf8)
+		{
+			blob_view s = pop_binary_view();
+			int32_t cp = s.length() > n - 1 ? n - 1 : s.length();
+
+			memcpy(v, s.buffer(), cp);
+			v[cp] = '\0';
+
+			return (int)strlen(v);
+		}
+
 		std::string s = pop_string();
 		strncpy(v, s.c_str(), n - 1);
 		v[n - 1] = '\0';
@@ -361,18 +722,15 @@ public:
 		return (int)strlen(v);
 	}
 
-	virtual blob pop_binary()
+	blob pop_binary()
 	{
-		int32_t len = pop_int32();
-
-		if (m_popped + len > m_buffer_occupied) throw std::out_of_range("not enough content.");
+		blob_view b = pop_binary_view();
 
-		m_popped += len;
-
-		return blob(m_buffer + m_popped - len, len);
+		return blob((byte *)b.buffer(), b.length());
 	}
 
-	virtual int32_t pop_binary(void * v, int32_t n)
+	// same as pop_string(char *, int32_t) for the content
+	int32_t pop_binary(void * v, int32_t n)
 	{
 		// n may greater or less than the real length of content
 
@@ -385,52 +743,117 @@ public:
 
 		if (n < 0) throw std::invalid_argument("invalid buffer length.");
 
-		blob b = pop_binary();
+		blob_view b = pop_binary_view();
 		int32_t cp = b.length() > n ? n : b.length();
 
 		memcpy(v, b.buffer(), cp);
 		return cp;
 	}
 
-	virtual int32_t pop_raw(void * v, int32_t n)
+	int32_t pop_raw(void * v, int32_t n)
 	{
 		if (v == NULL) throw std::invalid_argument("invalid buffer.");
 		if (n < 0) throw std::invalid_argument("invalid buffer length");
 
-		m_popped += n;
-		memcpy(v, m_buffer + m_popped - n, n);
+		blob_view b = pop_raw_view(n);
+		memcpy(v, b.buffer(), n);
 
 		return n;
 	}
 
-	virtual blob pop_raw(int32_t n)
+	blob pop_raw(int32_t n)
+	{
+		blob_view b = pop_raw_view(n);
+
+		return blob((byte *)b.buffer(), n);
+	}
+
+	// zero-copy pops: the views point into the packer buffer, see blob_view.
+	// pop_string_view() gives the string as packed, in UTF-8 whatever the packer charset.
+#ifdef IMSUX_PACKER_STRING_VIEW
+	std::string_view pop_string_view()
+	{
+		blob_view b = pop_binary_view();
+
+		return std::string_view((const char *)b.buffer(), b.length());
+	}
+#endif
+
+	blob_view pop_binary_view()
 	{
+		int32_t len = pop_int32();
+
+		if (len < 0 || m_popped + len > m_buffer_occupied)
+		{
+			m_popped -= (int)sizeof(int32_t);
+			throw std::out_of_range("not enough content.");
+		}
+
+		m_popped += len;
+		return blob_view(m_buffer + m_popped - len, len);
+	}
+
+	blob_view pop_raw_view(int32_t n)
+	{
+		if (n < 0) throw std::invalid_argument("invalid buffer length");
 		if (m_popped + n > m_buffer_occupied) throw std::out_of_range("not enough content.");
 
 		m_popped += n;
-		return blob(m_buffer + m_popped - n, n);
+		return blob_view(m_buffer + m_popped - n, n);
+	}
+
+	// n values pushed by push_array() or one by one
+	template <class T>
+	void pop_array(T * v, int32_t n)
+	{
+		static_assert(std::is_arithmetic<T>::value && (sizeof(T) & (sizeof(T) - 1)) == 0 && sizeof(T) <= 8, "not a packable value type");
+
+		if (!v && n) throw std::invalid_argument("invalid buffer.");
+		if (n < 0) throw std::invalid_argument("invalid array length.");
+		if ((int64_t)n * (int)sizeof(T) > m_buffer_occupied - m_popped) throw std::out_of_range("not enough content.");
+
+		Order::convert_array((byte *)v, m_buffer + m_popped, n, (int)sizeof(T));
+		m_popped += n * (int)sizeof(T);
 	}
 
 protected:
 	void ensure_buffer_enough(size_t extend_size)
 	{
-		if ((int32_t)extend_size + m_buffer_occupied > m_buffer_len)
+		if ((int32_t)extend_size + m_buffer_occupied > m_buffer_len) grow_buffer(extend_size);
+	}
+
+	// out of line, so that the check above is all a push inlines
+	void grow_buffer(size_t extend_size)
+	{
+		if (!m_buffer_doclean) throw std::logic_error("bound buffer cannot grow.");
+
+		int32_t len = m_buffer_len;
+		do
 		{
-			if (!m_buffer_doclean) throw std::logic_error("bound buffer cannot grow.");
+			len += len;
+		}
+		while ((int32_t)extend_size + m_buffer_occupied > len);
 
-			do
-			{
-				m_buffer_len += m_buffer_len;
-			}
-			while ((int32_t)extend_size + m_buffer_occupied > m_buffer_len);
+		byte * new_buffer = allocate_buffer(len);
 
-			byte * new_buffer = new byte [m_buffer_len];
+		memcpy(new_buffer, m_buffer, m_buffer_occupied);
+		release_buffer(m_buffer, m_buffer_len);
+		m_buffer = new_buffer;
+		m_buffer_len = len;
+	}
 
-			memset(new_buffer, 0, m_buffer_len);
-			memcpy(new_buffer, m_buffer, m_buffer_occupied);
-			delete [] m_buffer;
-			m_buffer = new_buffer;
-		}
+	// len may come back larger
+	byte * allocate_buffer(int32_t & len)
+	{
+		packer_allocator * a = m_allocator ? m_allocator : packer_buffer_pool::local();
+		return a ? a->allocate(len) : new byte [len];
+	}
+
+	void release_buffer(byte * buffer, int32_t len)
+	{
+		packer_allocator * a = m_allocator ? m_allocator : packer_buffer_pool::local();
+		if (a) a->deallocate(buffer, len);
+		else delete [] buffer;
 	}
 
 	template <class T>
@@ -438,22 +861,21 @@ protected:
 	{
 		ensure_buffer_enough(sizeof(T));
 
-		T v2 = value_packer::convert_endian(v);
-		memcpy(m_buffer + m_buffer_occupied, &v2, (int)sizeof(T));
+		T v2 = Order::convert(v);
+		memcpy(m_buffer + m_buffer_occupied, &v2, sizeof(T));
 		m_buffer_occupied += (int)sizeof(T);
 	}
 
-	// MSVC 6.0 does not support this: T Foo::Get<T>()... -_-!
 	template <class T>
-	T unpack_single_value(T)
+	T unpack_single_value()
 	{
 		if (m_popped + (int)sizeof(T) > m_buffer_occupied) throw std::out_of_range("no more content.");
 
 		T v;
-		memcpy(&v, m_buffer + m_popped, (int)sizeof(T));
+		memcpy(&v, m_buffer + m_popped, sizeof(T));
 		m_popped += (int)sizeof(T);
 
-		return value_packer::convert_endian(v);
+		return Order::convert(v);
 	}
 
 protected:
@@ -464,8 +886,96 @@ protected:
 	int32_t m_buffer_len;
 	int32_t m_buffer_occupied;
 	int32_t m_popped;
+	packer_allocator * m_allocator;
+	bool m_utf8;	// m_charset needs no conversion
+};
+
+// the value_packer interface over basic_packer, for code that takes any packer
+class binary_packer : public value_packer, protected basic_packer<big_endian_order>
+{
+	typedef basic_packer<big_endian_order> base;
+
+public:
+	using base::default_buffer_len;
+
+	binary_packer(int32_t init_buffer = 0, const char * charset = "", packer_allocator * allocator = NULL)
+		: base(init_buffer, charset, allocator)
+	{
+	}
+
+	virtual ~binary_packer()
+	{
+	}
+
+public:
+	// access interfaces
+	virtual void * buffer() { return base::buffer(); }
+	virtual int32_t length() const { return base::length(); }
+	virtual void bind(byte * buffer, int32_t buffer_len) { base::bind(buffer, buffer_len); }
+	virtual void reset() { base::reset(); }
+
+	// push interfaces
+	virtual void push_int8 (int8_t  v) { base::push_int8 (v); }
+	virtual void push_int16(int16_t v) { base::push_int16(v); }
+	virtual void push_int32(int32_t v) { base::push_int32(v); }
+	virtual void push_int64(int64_t v) { base::push_int64(v); }
+	virtual void push_float(float   v) { base::push_float(v); }
+	virtual void push_double(double v) { base::push_double(v); }
+
+	virtual void push_uint8 (uint8_t  v) { push_int8 ((int8_t )v); }
+	virtual void push_uint16(uint16_t v) { push_int16((int16_t)v); }
+	virtual void push_uint32(uint32_t v) { push_int32((int32_t)v); }
+	virtual void push_uint64(uint64_t v) { push_int64((int64_t)v); }
+
+	using value_packer::push_string;
+	virtual void push_string(const char * v, int32_t n = -1) { base::push_string(v, n); }
+
+	using value_packer::push_binary;
+	virtual void push_binary(const void * v, int32_t n) { base::push_binary(v, n); }
+
+	using value_packer::push_raw;
+	virtual void push_raw(const void * v, int32_t n) { base::push_raw(v, n); }
+
+	// pop interfaces
+	virtual void pop_reset(int32_t pos = 0) { base::pop_reset(pos); }
+
+	virtual int8_t  pop_int8 () { return base::pop_int8 (); }
+	virtual int16_t pop_int16() { return base::pop_int16(); }
+	virtual int32_t pop_int32() { return base::pop_int32(); }
+	virtual int64_t pop_int64() { return base::pop_int64(); }
+	virtual float   pop_float() { return base::pop_float(); }
+	virtual double  pop_double(){ return base::pop_double(); }
+
+	virtual uint8_t  pop_uint8 () { return (uint8_t )pop_int8 (); }
+	virtual uint16_t pop_uint16() { return (uint16_t)pop_int16(); }
+	virtual uint32_t pop_uint32() { return (uint32_t)pop_int32(); }
+	virtual uint64_t pop_uint64() { return (uint64_t)pop_int64(); }
+
+	virtual std::string pop_string() { return base::pop_string(); }
+	virtual int32_t pop_string(char * v, int32_t n) { return base::pop_string(v, n); }
+
+	virtual blob pop_binary() { return base::pop_binary(); }
+	virtual int32_t pop_binary(void * v, int32_t n) { return base::pop_binary(v, n); }
+
+	virtual int32_t pop_raw(void * v, int32_t n) { return base::pop_raw(v, n); }
+	virtual blob pop_raw(int32_t n) { return base::pop_raw(n); }
+
+	using base::order_type;
+	using base::push_space;
+	using base::pop_position;
+	using base::string_conv;
+
+	using base::push_array;
+	using base::pop_array;
+
+#ifdef IMSUX_PACKER_STRING_VIEW
+	using base::pop_string_view;
+#endif
+	using base::pop_binary_view;
+	using base::pop_raw_view;
 };
 
 } // namespace imsux
 
+
 #endif //IECAS_PACKER_H_INCLUDED__
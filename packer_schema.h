@@ -0,0 +1,411 @@
+// packer_schema.h: pack and unpack whole structs, from one declaration of their fields.
+//
+//   struct quote { int32_t id; double price; std::string symbol; std::vector<int64_t> ticks; };
+//   IMSUX_PACKER_SCHEMA(quote, &quote::id, &quote::price, &quote::symbol, &quote::ticks)
+//
+//   pack_struct(packer, q);      // the same bytes as the push_xxx() calls field by field
+//   unpack_struct(packer, q);
+//
+// fields are the arithmetic types and bool, arrays of them, std::string (as push_string(), in
+// the packer's charset), std::vector of any field type (int32 count, then the elements, arrays of
+// numbers as push_array()), and structs with a schema of their own, packed inline.
+// pack_struct() works out the encoded size first, reserves it with one check and writes every
+// field unchecked. unpack_struct() checks each run of fixed size fields once, and only
+// variable length fields on their own; a failed unpack leaves the pop position unchanged.
+// the packer can be a basic_packer or a binary_packer.
+
+#ifndef IMSUX_PACKER_SCHEMA_H_INCLUDED__
+#define IMSUX_PACKER_SCHEMA_H_INCLUDED__
+
+#if __cplusplus < 201703L && !(defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#error packer_schema.h needs C++17.
+#endif
+
+#include <tuple>
+#include <string>
+#include <vector>
+#include <type_traits>
+#include "packer.h"
+
+namespace imsux {
+
+// fields() of a struct: a tuple of member pointers, in wire order
+template <class S>
+struct packer_schema;
+
+// at global scope, after the struct
+#define IMSUX_PACKER_SCHEMA(type, ...)									\
+	namespace imsux {													\
+	template <> struct packer_schema<type>								\
+	{																	\
+		static constexpr auto fields() { return std::make_tuple(__VA_ARGS__); }	\
+	};																	\
+	}
+
+// how one field type is coded. fixed ones have a width and get() reads them unchecked,
+// variable ones the least bytes a value of them takes as min_width; put() is always
+// unchecked, the space is reserved beforehand. conv is the packer's string_conv(), NULL
+// when strings are copied as they are.
+template <class F, class Enable = void>
+struct packer_field;
+
+template <class F>
+struct packer_field<F, typename std::enable_if<std::is_arithmetic<F>::value && !std::is_same<F, bool>::value>::type>
+{
+	static constexpr bool fixed = true;
+	static constexpr size_t width = sizeof(F);
+
+	static size_t size(const F &, const utf8_conv * = NULL) { return sizeof(F); }
+
+	template <class Order>
+	static void put(byte *& p, const F & v, const utf8_conv * = NULL)
+	{
+		F v2 = Order::convert(v);
+		memcpy(p, &v2, sizeof(F));
+		p += sizeof(F);
+	}
+
+	template <class Order>
+	static void get(const byte *& p, const byte *, F & v, const utf8_conv * = NULL)
+	{
+		memcpy(&v, p, sizeof(F));
+		v = Order::convert(v);
+		p += sizeof(F);
+	}
+};
+
+template <>
+struct packer_field<bool>
+{
+	static constexpr bool fixed = true;
+	static constexpr size_t width = 1;
+
+	static size_t size(const bool &, const utf8_conv * = NULL) { return 1; }
+
+	template <class Order>
+	static void put(byte *& p, const bool & v, const utf8_conv * = NULL) { *p++ = v ? 1 : 0; }
+
+	template <class Order>
+	static void get(const byte *& p, const byte *, bool & v, const utf8_conv * = NULL) { v = *p++ != 0; }
+};
+
+// numbers only, packed as push_array()
+template <class E, size_t N>
+struct packer_field<E[N], typename std::enable_if<std::is_arithmetic<E>::value && !std::is_same<E, bool>::value>::type>
+{
+	static constexpr bool fixed = true;
+	static constexpr size_t width = N * sizeof(E);
+
+	static size_t size(const E (&)[N], const utf8_conv * = NULL) { return width; }
+
+	template <class Order>
+	static void put(byte *& p, const E (&v)[N], const utf8_conv * = NULL)
+	{
+		Order::convert_array(p, (const byte *)v, N, (int)sizeof(E));
+		p += width;
+	}
+
+	template <class Order>
+	static void get(const byte *& p, const byte *, E (&v)[N], const utf8_conv * = NULL)
+	{
+		Order::convert_array((byte *)v, p, N, (int)sizeof(E));
+		p += width;
+	}
+};
+
+// the checks of the variable length fields
+inline void packer_field_need(const byte * p, const byte * end, size_t n)
+{
+	if ((size_t)(end - p) < n) throw std::out_of_range("no more content.");
+}
+
+template <class Field>
+constexpr size_t packer_field_min_width()
+{
+	if constexpr (Field::fixed) return Field::width;
+	else return Field::min_width;
+}
+
+template <class Order>
+inline int32_t packer_field_count(const byte *& p, const byte * end)
+{
+	int32_t n;
+	packer_field_need(p, end, sizeof(n));
+	packer_field<int32_t>::get<Order>(p, end, n);
+
+	if (n < 0) throw std::out_of_range("invalid length.");
+	return n;
+}
+
+template <>
+struct packer_field<std::string>
+{
+	static constexpr bool fixed = false;
+	static constexpr size_t min_width = sizeof(int32_t);
+
+	// a string that needs converting is converted for size() and again for put()
+	static size_t size(const std::string & v, const utf8_conv * conv)
+	{
+		if (conv) return sizeof(int32_t) + conv->to_utf8(v).length();
+		return sizeof(int32_t) + v.length();
+	}
+
+	template <class Order>
+	static void put(byte *& p, const std::string & v, const utf8_conv * conv)
+	{
+		if (conv)
+		{
+			put_utf8<Order>(p, conv->to_utf8(v));
+			return;
+		}
+		put_utf8<Order>(p, v);
+	}
+
+	template <class Order>
+	static void get(const byte *& p, const byte * end, std::string & v, const utf8_conv * conv)
+	{
+		int32_t n = packer_field_count<Order>(p, end);
+		packer_field_need(p, end, n);
+
+		if (conv) v = conv->from_utf8((const char *)p, n);
+		else v.assign((const char *)p, n);
+		p += n;
+	}
+
+private:
+	template <class Order>
+	static void put_utf8(byte *& p, const std::string & utf8)
+	{
+		packer_field<int32_t>::put<Order>(p, (int32_t)utf8.length());
+		memcpy(p, utf8.data(), utf8.length());
+		p += utf8.length();
+	}
+};
+
+template <class E>
+struct packer_field<std::vector<E> >
+{
+	typedef packer_field<E> element;
+
+	// numbers go through the bulk byte swap
+	static constexpr bool numbers = std::is_arithmetic<E>::value && !std::is_same<E, bool>::value;
+	static constexpr bool fixed = false;
+	static constexpr size_t min_width = sizeof(int32_t);
+
+	static_assert(packer_field_min_width<element>() > 0, "elements must take some bytes");
+
+	static size_t size(const std::vector<E> & v, const utf8_conv * conv)
+	{
+		size_t n = sizeof(int32_t);
+		if constexpr (element::fixed)
+		{
+			n += v.size() * element::width;
+		}
+		else
+		{
+			for (size_t i=0; i<v.size(); ++i) n += element::size(v[i], conv);
+		}
+		return n;
+	}
+
+	template <class Order>
+	static void put(byte *& p, const std::vector<E> & v, const utf8_conv * conv)
+	{
+		packer_field<int32_t>::put<Order>(p, (int32_t)v.size());
+		if constexpr (numbers)
+		{
+			Order::convert_array(p, (const byte *)v.data(), v.size(), (int)sizeof(E));
+			p += v.size() * sizeof(E);
+		}
+		else
+		{
+			for (size_t i=0; i<v.size(); ++i) element::template put<Order>(p, v[i], conv);
+		}
+	}
+
+	template <class Order>
+	static void get(const byte *& p, const byte * end, std::vector<E> & v, const utf8_conv * conv)
+	{
+		// the count is checked against the bytes left before anything is allocated for it
+		int32_t n = packer_field_count<Order>(p, end);
+		packer_field_need(p, end, (size_t)n * packer_field_min_width<element>());
+
+		v.resize(n);
+		if constexpr (numbers)
+		{
+			Order::convert_array((byte *)v.data(), p, n, (int)sizeof(E));
+			p += n * sizeof(E);
+		}
+		else
+		{
+			for (int32_t i=0; i<n; ++i) element::template get<Order>(p, end, v[i], conv);
+		}
+	}
+};
+
+// packed bits have no bool & to decode into: element by element, one byte each
+template <>
+struct packer_field<std::vector<bool> >
+{
+	static constexpr bool fixed = false;
+	static constexpr size_t min_width = sizeof(int32_t);
+
+	static size_t size(const std::vector<bool> & v, const utf8_conv * = NULL) { return sizeof(int32_t) + v.size(); }
+
+	template <class Order>
+	static void put(byte *& p, const std::vector<bool> & v, const utf8_conv * = NULL)
+	{
+		packer_field<int32_t>::put<Order>(p, (int32_t)v.size());
+		for (size_t i=0; i<v.size(); ++i) *p++ = v[i] ? 1 : 0;
+	}
+
+	template <class Order>
+	static void get(const byte *& p, const byte * end, std::vector<bool> & v, const utf8_conv * = NULL)
+	{
+		int32_t n = packer_field_count<Order>(p, end);
+		packer_field_need(p, end, n);
+
+		v.resize(n);
+		for (int32_t i=0; i<n; ++i) v[i] = *p++ != 0;
+	}
+};
+
+// type of the field a member pointer points to
+template <class M>
+struct packer_member;
+
+template <class S, class F>
+struct packer_member<F S::*>
+{
+	typedef F type;
+};
+
+// structs declared with IMSUX_PACKER_SCHEMA
+template <class S>
+struct packer_field<S, typename std::enable_if<sizeof(packer_schema<S>) != 0>::type>
+{
+	static constexpr size_t count = std::tuple_size<decltype(packer_schema<S>::fields())>::value;
+
+	template <size_t I>
+	using field = packer_field<typename packer_member<typename std::decay<decltype(std::get<I>(packer_schema<S>::fields()))>::type>::type>;
+
+	template <size_t I>
+	static constexpr bool fixed_from()
+	{
+		if constexpr (I == count) return true;
+		else return field<I>::fixed && fixed_from<I + 1>();
+	}
+
+	// width of the fixed fields from I up to the first variable one
+	template <size_t I>
+	static constexpr size_t run_from()
+	{
+		if constexpr (I == count) return 0;
+		else if constexpr (!field<I>::fixed) return 0;
+		else return field<I>::width + run_from<I + 1>();
+	}
+
+	template <size_t I>
+	static constexpr size_t min_from()
+	{
+		if constexpr (I == count) return 0;
+		else return packer_field_min_width<field<I> >() + min_from<I + 1>();
+	}
+
+	static constexpr bool fixed = fixed_from<0>();
+	static constexpr size_t width = run_from<0>();
+	static constexpr size_t min_width = min_from<0>();
+
+	static size_t size(const S & v, const utf8_conv * conv)
+	{
+		if constexpr (fixed) return width;
+		else return size_from<0>(v, conv);
+	}
+
+	template <class Order>
+	static void put(byte *& p, const S & v, const utf8_conv * conv)
+	{
+		put_from<Order, 0>(p, v, conv);
+	}
+
+	// a fixed struct is read unchecked like any fixed field, within its run
+	template <class Order>
+	static void get(const byte *& p, const byte * end, S & v, const utf8_conv * conv)
+	{
+		get_from<Order, 0, !fixed>(p, end, v, conv);
+	}
+
+	// the outermost struct of an unpack checks its first run too
+	template <class Order>
+	static void get_checked(const byte *& p, const byte * end, S & v, const utf8_conv * conv)
+	{
+		get_from<Order, 0, true>(p, end, v, conv);
+	}
+
+private:
+	template <size_t I>
+	static size_t size_from(const S & v, const utf8_conv * conv)
+	{
+		if constexpr (I == count) return 0;
+		else return field<I>::size(v.*std::get<I>(packer_schema<S>::fields()), conv) + size_from<I + 1>(v, conv);
+	}
+
+	template <class Order, size_t I>
+	static void put_from(byte *& p, const S & v, const utf8_conv * conv)
+	{
+		if constexpr (I < count)
+		{
+			field<I>::template put<Order>(p, v.*std::get<I>(packer_schema<S>::fields()), conv);
+			put_from<Order, I + 1>(p, v, conv);
+		}
+	}
+
+	// check: whether the run starting at I needs a check
+	template <class Order, size_t I, bool check>
+	static void get_from(const byte *& p, const byte * end, S & v, const utf8_conv * conv)
+	{
+		if constexpr (I < count)
+		{
+			if constexpr (check && field<I>::fixed) packer_field_need(p, end, run_from<I>());
+
+			field<I>::template get<Order>(p, end, v.*std::get<I>(packer_schema<S>::fields()), conv);
+
+			// the next run, after a variable length field, is checked again
+			get_from<Order, I + 1, !field<I>::fixed>(p, end, v, conv);
+		}
+	}
+};
+
+// bytes pack_struct() adds for v, to a packer whose string_conv() is conv
+template <class S>
+size_t packed_size(const S & v, const utf8_conv * conv = NULL)
+{
+	return packer_field<S>::size(v, conv);
+}
+
+template <class P, class S>
+void pack_struct(P & packer, const S & v)
+{
+	const utf8_conv * conv = packer.string_conv();
+
+	size_t n = packer_field<S>::size(v, conv);
+	if (n > 0x7fffffff - (size_t)packer.length()) throw std::length_error("struct too long.");
+
+	byte * p = packer.push_space((int32_t)n);
+	packer_field<S>::template put<typename P::order_type>(p, v, conv);
+}
+
+template <class P, class S>
+void unpack_struct(P & packer, S & v)
+{
+	const byte * begin = (const byte *)packer.buffer() + packer.pop_position();
+	const byte * end = (const byte *)packer.buffer() + packer.length();
+	const byte * p = begin;
+
+	packer_field<S>::template get_checked<typename P::order_type>(p, end, v, packer.string_conv());
+	packer.pop_raw_view((int32_t)(p - begin));
+}
+
+} // namespace imsux
+
+#endif//IMSUX_PACKER_SCHEMA_H_INCLUDED__
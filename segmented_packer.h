@@ -0,0 +1,325 @@
+// segmented_packer.h: packer output as a chain of segments, for writev() and sendmsg().
+//
+// pushes go into fixed size segments taken from a packer_allocator, so a growing message is
+// never reallocated or copied; push_raw_ref() and push_binary_ref() put caller owned payloads
+// in the chain without copying them. the bytes are the same as a basic_packer with the same
+// pushes would hold. iov() lists them in order, write_to() writes them to a descriptor, and
+// goes on where a non-blocking one stopped taking them.
+// output only: a received message is popped with a binary_packer bound to it.
+
+#ifndef IMSUX_SEGMENTED_PACKER_H_INCLUDED__
+#define IMSUX_SEGMENTED_PACKER_H_INCLUDED__
+
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "packer.h"
+
+namespace imsux {
+
+template <class Order = big_endian_order>
+class basic_segmented_packer
+{
+public:
+	// referenced payloads shorter than this are copied, an iovec entry costs more
+	enum { copy_below = 512 };
+
+	basic_segmented_packer(int32_t segment_size = 64 << 10, const char * charset = "", packer_allocator * allocator = NULL)
+		: m_conv(charset)
+		, m_segment_size(segment_size)
+		, m_allocator(allocator)
+		, m_segment(NULL)
+		, m_segment_used(0)
+		, m_segment_len(0)
+		, m_length(0)
+		, m_tail_open(false)
+	{
+		if (segment_size < 16) throw std::invalid_argument("invalid segment size.");
+
+		m_utf8 = m_conv.is_utf8();
+	}
+
+	~basic_segmented_packer()
+	{
+		release_segments(0);
+	}
+
+private:
+	basic_segmented_packer(const basic_segmented_packer &);
+	basic_segmented_packer & operator = (const basic_segmented_packer &);
+
+public:
+	// access interfaces
+	const iovec * iov() const { return m_iov.empty() ? NULL : &m_iov[0]; }
+	int iov_count() const { return (int)m_iov.size(); }
+	size_t length() const { return m_length; }
+
+	// empties the chain, keeping the first segment for the next message
+	void reset()
+	{
+		release_segments(1);
+		m_iov.clear();
+		m_tail_open = false;
+		m_segment = m_segments.empty() ? NULL : m_segments[0].buffer;
+		m_segment_len = m_segments.empty() ? 0 : m_segments[0].len;
+		m_segment_used = 0;
+		m_length = 0;
+	}
+
+	// writes the message from byte `from` on, IOV_MAX entries per writev(); returns how far
+	// it got: length() once all of it is written, less with errno set on failure. on a
+	// non-blocking descriptor (EAGAIN) a later call with that offset goes on from there.
+	size_t write_to(int fd, size_t from = 0) const
+	{
+		// the entry holding byte `from`, and how far into it
+		size_t first = 0, skip = from;
+		while (first < m_iov.size() && skip >= m_iov[first].iov_len)
+		{
+			skip -= m_iov[first].iov_len;
+			++first;
+		}
+
+		size_t done = from;
+		while (first < m_iov.size())
+		{
+			int n = (int)std::min(m_iov.size() - first, (size_t)IOV_MAX);
+			ssize_t written;
+			if (skip)
+			{
+				// the rest of a partly written entry, m_iov itself stays as iov() lists it
+				std::vector<iovec> iov(m_iov.begin() + first, m_iov.begin() + first + n);
+				iov[0].iov_base = (char *)iov[0].iov_base + skip;
+				iov[0].iov_len -= skip;
+				written = ::writev(fd, &iov[0], n);
+			}
+			else
+			{
+				written = ::writev(fd, &m_iov[first], n);
+			}
+			if (written < 0)
+			{
+				if (errno == EINTR) continue;
+				return done;
+			}
+
+			// skip what was written, the rest of a partly written entry goes next
+			done += written;
+			skip += written;
+			while (first < m_iov.size() && skip >= m_iov[first].iov_len)
+			{
+				skip -= m_iov[first].iov_len;
+				++first;
+			}
+		}
+		return done;
+	}
+
+	// the message in one piece, at least length() bytes
+	void copy_to(void * buffer) const
+	{
+		byte * p = (byte *)buffer;
+		for (size_t i=0; i<m_iov.size(); ++i)
+		{
+			memcpy(p, m_iov[i].iov_base, m_iov[i].iov_len);
+			p += m_iov[i].iov_len;
+		}
+	}
+
+	// push interfaces, as basic_packer
+	void push_int8 (int8_t  v) { pack_single_value(v); }
+	void push_int16(int16_t v) { pack_single_value(v); }
+	void push_int32(int32_t v) { pack_single_value(v); }
+	void push_int64(int64_t v) { pack_single_value(v); }
+	void push_float(float   v) { pack_single_value(v); }
+	void push_double(double v) { pack_single_value(v); }
+
+	void push_uint8 (uint8_t  v) { pack_single_value(v); }
+	void push_uint16(uint16_t v) { pack_single_value(v); }
+	void push_uint32(uint32_t v) { pack_single_value(v); }
+	void push_uint64(uint64_t v) { pack_single_value(v); }
+
+	void push_string(const char * v, int32_t n = -1)
+	{
+		if (n < -1) throw std::invalid_argument("invalid string length.");
+		if (!v) throw std::invalid_argument("null string specified.");
+
+		int32_t len = (n == -1) ? (int)strlen(v) : n;
+		if (m_utf8)
+		{
+			push_int32(len);
+			push_raw(v, len);
+			return;
+		}
+
+		std::string utf8 = m_conv.to_utf8(v, len);
+
+		push_int32((int)utf8.length());
+		push_raw(utf8.c_str(), (int)utf8.length());
+	}
+	void push_string(const std::string & s)
+	{
+		push_string(s.c_str(), (int)s.length());
+	}
+
+	void push_binary(const void * v, int32_t n)
+	{
+		if (!v) throw std::invalid_argument("invalid address.");
+		if (n < 0) throw std::invalid_argument("invalid buffer length.");
+
+		push_int32(n);
+		push_raw(v, n);
+	}
+
+	void push_raw(const void * v, int32_t n)
+	{
+		if (!v) throw std::invalid_argument("invalid address.");
+		if (n < 0) throw std::invalid_argument("invalid buffer length.");
+
+		const byte * p = (const byte *)v;
+		while (n)
+		{
+			int32_t cp = std::min(n, reserve(1));
+			memcpy(m_segment + m_segment_used, p, cp);
+			commit(cp);
+			p += cp;
+			n -= cp;
+		}
+	}
+
+	// v is referenced, not copied: it must stay unchanged until the message is written
+	void push_binary_ref(const void * v, int32_t n)
+	{
+		if (!v) throw std::invalid_argument("invalid address.");
+		if (n < 0) throw std::invalid_argument("invalid buffer length.");
+
+		push_int32(n);
+		push_raw_ref(v, n);
+	}
+
+	void push_raw_ref(const void * v, int32_t n)
+	{
+		if (!v) throw std::invalid_argument("invalid address.");
+		if (n < 0) throw std::invalid_argument("invalid buffer length.");
+		if (n < copy_below)
+		{
+			push_raw(v, n);
+			return;
+		}
+
+		iovec e = { (void *)v, (size_t)n };
+		m_iov.push_back(e);
+		m_tail_open = false;
+		m_length += n;
+	}
+
+	// as basic_packer::push_array()
+	template <class T>
+	void push_array(const T * v, int32_t n)
+	{
+		static_assert(std::is_arithmetic<T>::value && (sizeof(T) & (sizeof(T) - 1)) == 0 && sizeof(T) <= 8, "not a packable value type");
+
+		if (!v && n) throw std::invalid_argument("invalid address.");
+		if (n < 0) throw std::invalid_argument("invalid array length.");
+
+		while (n)
+		{
+			int32_t count = std::min(n, reserve((int32_t)sizeof(T)) / (int32_t)sizeof(T));
+			Order::convert_array(m_segment + m_segment_used, (const byte *)v, count, (int)sizeof(T));
+			commit(count * (int32_t)sizeof(T));
+			v += count;
+			n -= count;
+		}
+	}
+
+protected:
+	struct segment
+	{
+		byte * buffer;
+		int32_t len;
+	};
+
+	template <class T>
+	void pack_single_value(T v)
+	{
+		reserve((int32_t)sizeof(T));
+
+		T v2 = Order::convert(v);
+		memcpy(m_segment + m_segment_used, &v2, sizeof(T));
+		commit((int32_t)sizeof(T));
+	}
+
+	// room for at least n contiguous bytes at m_segment + m_segment_used; returns the room
+	int32_t reserve(int32_t n)
+	{
+		if (m_segment_len - m_segment_used < n) add_segment();
+		return m_segment_len - m_segment_used;
+	}
+
+	// n bytes were written at m_segment + m_segment_used
+	void commit(int32_t n)
+	{
+		byte * p = m_segment + m_segment_used;
+		if (m_tail_open && (byte *)m_iov.back().iov_base + m_iov.back().iov_len == p)
+		{
+			m_iov.back().iov_len += n;
+		}
+		else
+		{
+			iovec e = { p, (size_t)n };
+			m_iov.push_back(e);
+			m_tail_open = true;
+		}
+
+		m_segment_used += n;
+		m_length += n;
+	}
+
+	void add_segment()
+	{
+		segment s;
+		s.len = m_segment_size;
+		s.buffer = allocator() ? allocator()->allocate(s.len) : new byte [s.len];
+		m_segments.push_back(s);
+
+		m_segment = s.buffer;
+		m_segment_len = s.len;
+		m_segment_used = 0;
+	}
+
+	// all segments from keep on
+	void release_segments(size_t keep)
+	{
+		packer_allocator * a = allocator();
+		for (size_t i=keep; i<m_segments.size(); ++i)
+		{
+			if (a) a->deallocate(m_segments[i].buffer, m_segments[i].len);
+			else delete [] m_segments[i].buffer;
+		}
+		if (keep < m_segments.size()) m_segments.resize(keep);
+	}
+
+	packer_allocator * allocator() const
+	{
+		return m_allocator ? m_allocator : packer_buffer_pool::local();
+	}
+
+protected:
+	utf8_conv m_conv;
+	int32_t m_segment_size;
+	packer_allocator * m_allocator;
+	std::vector<segment> m_segments;
+	std::vector<iovec> m_iov;
+	byte * m_segment;			// the one being filled
+	int32_t m_segment_used;
+	int32_t m_segment_len;
+	size_t m_length;
+	bool m_tail_open;			// the last iov entry is in m_segment and may grow
+	bool m_utf8;				// no charset conversion needed
+};
+
+typedef basic_segmented_packer<> segmented_packer;
+
+} // namespace imsux
+
+#endif//IMSUX_SEGMENTED_PACKER_H_INCLUDED__
@@ -0,0 +1,70 @@
+// imslog_decode.cpp: turns binary logs written by logger.h (see logger::SetBinary) back into text.
+//
+// usage: imslog_decode [-c] <file.bin>...
+//   each "<name>.bin" is decoded into "<name>", so rotated names such as
+//   app.20091103.log.bin come back as app.20091103.log; -c writes to stdout instead.
+//
+// build: c++ -std=c++17 -o imslog_decode imslog_decode.cpp
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+
+#include "../logger.h"
+
+int main(int argc, char * argv[])
+{
+    bool toStdout = false;
+    int first = 1;
+    if (argc > 1 && strcmp(argv[1], "-c") == 0)
+    {
+        toStdout = true;
+        ++first;
+    }
+
+    if (first >= argc)
+    {
+        fprintf(stderr, "usage: %s [-c] <file.bin>...\n", argv[0]);
+        return 2;
+    }
+
+    int failed = 0;
+    for (int i = first; i < argc; ++i)
+    {
+        std::string in = argv[i];
+        size_t sl = strlen(IMSLOG_BINARY_SUFFIX);
+        bool suffixed = in.length() > sl && in.compare(in.length() - sl, sl, IMSLOG_BINARY_SUFFIX) == 0;
+        if (!toStdout && !suffixed)
+        {
+            fprintf(stderr, "%s: not a '%s' file, use -c to decode it to stdout.\n", in.c_str(), IMSLOG_BINARY_SUFFIX);
+            ++failed;
+            continue;
+        }
+
+        scoped_ptr<FILE, file_dtor> fin(fopen(in.c_str(), "rb"));
+        if (fin.get() == NULL)
+        {
+            fprintf(stderr, "cannot open '%s': %s\n", in.c_str(), strerror(errno));
+            ++failed;
+            continue;
+        }
+
+        std::string out = in.substr(0, in.length() - sl);
+        scoped_ptr<FILE, file_dtor> fout(toStdout ? NULL : fopen(out.c_str(), "wt"));
+        if (!toStdout && fout.get() == NULL)
+        {
+            fprintf(stderr, "cannot create '%s': %s\n", out.c_str(), strerror(errno));
+            ++failed;
+            continue;
+        }
+
+        if (!log_binary::decode(fin, toStdout ? stdout : fout.get(), logSeverity__, LSV_MAX))
+        {
+            fprintf(stderr, "%s: malformed or truncated binary log.\n", in.c_str());
+            ++failed;
+        }
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,147 @@
+// imslog_merge.cpp: merges the per-thread shards of a sharded log (see logger::SetSharded)
+// back into one file ordered by time stamp.
+//
+// usage: imslog_merge [-o <out>] <shard>...
+//   records keep their lines: a line that does not start with a "[...]" time stamp belongs
+//   to the record before it. records with equal stamps come in the order of the arguments,
+//   each shard being in order already. writes to stdout unless -o is given.
+//
+// build: c++ -std=c++17 -o imslog_merge imslog_merge.cpp
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include <queue>
+#include <stdexcept>
+
+#include "../auto.hxx"
+
+using namespace imsux;
+
+// one input with its next record read ahead
+struct shard_reader
+{
+    shard_reader(FILE * f) : file(f), done(false) { next(); }
+
+    // reads the record following the current one into stamp & text
+    void next()
+    {
+        text.swap(pending);
+        pending.clear();
+        if (text.empty() && !ReadLine(text))
+        {
+            done = true;
+            return;
+        }
+
+        size_t end = text[0] == '[' ? text.find(']') : std::string::npos;
+        stamp = end == std::string::npos ? std::string() : text.substr(0, end + 1);
+
+        std::string line;
+        while (ReadLine(line))
+        {
+            if (line[0] == '[')
+            {
+                pending.swap(line);
+                break;
+            }
+            text += line;
+        }
+    }
+
+    bool ReadLine(std::string & line)
+    {
+        line.clear();
+        char buff[4096];
+        while (fgets(buff, sizeof(buff), file))
+        {
+            line += buff;
+            if (line[line.length() - 1] == '\n') break;
+        }
+        return !line.empty();
+    }
+
+    FILE * file;
+    bool done;
+    std::string stamp;
+    std::string text;
+    std::string pending;    // first line of the record after text
+};
+
+struct later
+{
+    later(std::vector<shard_reader *> & r) : readers(r) {}
+
+    bool operator () (int a, int b) const
+    {
+        int c = readers[a]->stamp.compare(readers[b]->stamp);
+        return c != 0 ? c > 0 : a > b;
+    }
+
+    std::vector<shard_reader *> & readers;
+};
+
+int main(int argc, char * argv[])
+{
+    const char * output = NULL;
+    int first = 1;
+    if (argc > 2 && strcmp(argv[1], "-o") == 0)
+    {
+        output = argv[2];
+        first = 3;
+    }
+
+    if (first >= argc)
+    {
+        fprintf(stderr, "usage: %s [-o <out>] <shard>...\n", argv[0]);
+        return 2;
+    }
+
+    std::vector<FILE *> files;
+    std::vector<shard_reader *> readers;
+    for (int i = first; i < argc; ++i)
+    {
+        FILE * f = fopen(argv[i], "rb");
+        if (f == NULL)
+        {
+            fprintf(stderr, "cannot open '%s': %s\n", argv[i], strerror(errno));
+            return 1;
+        }
+        files.push_back(f);
+        readers.push_back(new shard_reader(f));
+    }
+
+    scoped_ptr<FILE, file_dtor> fout(output ? fopen(output, "wb") : NULL);
+    if (output && fout.get() == NULL)
+    {
+        fprintf(stderr, "cannot create '%s': %s\n", output, strerror(errno));
+        return 1;
+    }
+    FILE * out = output ? fout.get() : stdout;
+
+    std::priority_queue<int, std::vector<int>, later> heap((later(readers)));
+    for (size_t i = 0; i < readers.size(); ++i)
+    {
+        if (!readers[i]->done) heap.push((int)i);
+    }
+
+    while (!heap.empty())
+    {
+        int i = heap.top();
+        heap.pop();
+
+        fwrite(readers[i]->text.data(), 1, readers[i]->text.length(), out);
+        readers[i]->next();
+        if (!readers[i]->done) heap.push(i);
+    }
+
+    for (size_t i = 0; i < readers.size(); ++i)
+    {
+        delete readers[i];
+        fclose(files[i]);
+    }
+
+    return ferror(out) ? 1 : 0;
+}
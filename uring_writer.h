@@ -0,0 +1,506 @@
+// uring_writer.h: batched sequential file output through io_uring.
+//
+// appends are copied into a small set of registered buffers; a full buffer, or what flush()
+// finds appended since the last one, becomes one IORING_OP_WRITE_FIXED at the next file
+// offset, so many records cost one submission and the caller never waits for the disk
+// unless every buffer is in flight. a buffer keeps filling after a flush, behind the part
+// already submitted, so frequent flushes do not use up the buffers.
+// io_uring is opt-in: it is built with IMSLOG_URING defined, on Linux with <linux/io_uring.h>.
+// without it, or where the ring cannot be set up (old kernel, seccomp, IMSLOG_NO_URING in the
+// environment), the same writes are done by a worker thread with pwritev(), several per call.
+//
+// used by logger.h as the log_file::uring_file backend; anything else producing bytes, e.g.
+// a binary_packer, can go through append(buffer, length) as well.
+
+#ifndef IMSLOG_URING_WRITER_H_INCLUDED__
+#define IMSLOG_URING_WRITER_H_INCLUDED__
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined(IMSLOG_URING) && defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define IMSLOG_HAVE_URING
+#endif
+#endif
+
+#ifdef IMSLOG_HAVE_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class uring_writer
+{
+public:
+    uring_writer(size_t bufferSize = 256 << 10, int buffers = 8, int depth = 64)
+        : mFd(-1)
+        , mBufferSize(bufferSize)
+        , mCurrent(-1)
+        , mOffset(0)
+        , mError(0)
+        , mRing(-1)
+        , mFixed(false)
+        , mInflight(0)
+        , mStopping(false)
+    {
+        mBuffers.resize(buffers);
+        for (int i=0; i<buffers; ++i)
+        {
+            mBuffers[i].data = (char *)aligned_alloc(4096, (bufferSize + 4095) / 4096 * 4096);
+            mBuffers[i].used = 0;
+            mBuffers[i].submitted = 0;
+            mBuffers[i].pending = 0;
+        }
+
+#ifdef IMSLOG_HAVE_URING
+        memset(&mSq, 0, sizeof(mSq));
+        memset(&mCq, 0, sizeof(mCq));
+#endif
+        if (getenv("IMSLOG_NO_URING") == NULL) SetupRing(depth);
+        if (mRing < 0) mWorker = std::thread(&uring_writer::WorkerProc, this);
+    }
+
+    ~uring_writer()
+    {
+        close();
+
+        if (mWorker.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(mLock);
+                mStopping = true;
+                mCond.notify_all();
+            }
+            mWorker.join();
+        }
+
+#ifdef IMSLOG_HAVE_URING
+        if (mRing >= 0)
+        {
+            munmap(mSq.map, mSq.mapSize);
+            if (mCq.map != mSq.map) munmap(mCq.map, mCq.mapSize);
+            munmap(mSqes, mSqesSize);
+            ::close(mRing);
+        }
+#endif
+
+        for (size_t i=0; i<mBuffers.size(); ++i) free(mBuffers[i].data);
+    }
+
+    // appends go to the end of the file as it is now; false with errno set on failure
+    bool open(const char * path)
+    {
+        close();
+        mFd = ::open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (mFd < 0) return false;
+
+        struct stat st;
+        if (fstat(mFd, &st) != 0)
+        {
+            ::close(mFd);
+            mFd = -1;
+            return false;
+        }
+
+        mOffset = st.st_size;
+        mError = 0;
+        return true;
+    }
+
+    size_t append(const void * data, size_t len)
+    {
+        const char * p = (const char *)data;
+        size_t left = len;
+        while (left)
+        {
+            if (mCurrent < 0) mCurrent = Acquire();
+
+            buffer & b = mBuffers[mCurrent];
+            size_t n = std::min(left, mBufferSize - b.used);
+            memcpy(b.data + b.used, p, n);
+            b.used += n;
+            p += n;
+            left -= n;
+
+            if (b.used == mBufferSize) Submit();
+        }
+        return len;
+    }
+
+    // hands what was appended so far to the kernel, without waiting for it
+    void flush()
+    {
+        if (mCurrent >= 0) Submit();
+    }
+
+    // flush() and wait until all of it is written
+    void drain()
+    {
+        flush();
+        if (mRing >= 0)
+        {
+            while (mInflight) Reap(true);
+        }
+        else
+        {
+            std::unique_lock<std::mutex> lock(mLock);
+            mFreed.wait(lock, [&]() { return mQueue.empty() && mInflight == 0; });
+        }
+    }
+
+    void sync()
+    {
+        drain();
+        if (mFd >= 0) fdatasync(mFd);
+    }
+
+    void close()
+    {
+        if (mFd < 0) return;
+
+        drain();
+        ::close(mFd);
+        mFd = -1;
+    }
+
+    // for crash handlers: no locks, no waiting; what is still buffered and then data are
+    // written directly behind anything in flight
+    void write_through(const void * data, size_t len)
+    {
+        if (mFd < 0) return;
+
+        if (mCurrent >= 0)
+        {
+            buffer & b = mBuffers[mCurrent];
+            size_t n = b.used - b.submitted;
+            if (n && pwrite(mFd, b.data + b.submitted, n, mOffset) == (ssize_t)n) mOffset += n;
+            b.submitted = b.used;
+        }
+        if (pwrite(mFd, data, len, mOffset) == (ssize_t)len) mOffset += len;
+    }
+
+    // the file length once everything appended is written
+    long size() const
+    {
+        if (mCurrent < 0) return mOffset;
+        return mOffset + (long)(mBuffers[mCurrent].used - mBuffers[mCurrent].submitted);
+    }
+
+    int fd() const { return mFd; }
+    // false when the pwritev() worker is used
+    bool uring() const { return mRing >= 0; }
+    // errno of the last failed write, 0 if none
+    int error() const { return mError.load(); }
+
+private:
+    struct buffer
+    {
+        char * data;
+        size_t used;
+        size_t submitted;   // data before this is written or being written
+        int pending;        // writes in flight from this buffer
+    };
+
+    // one write in flight: part of a buffer at a file offset
+    struct op
+    {
+        int buffer;
+        size_t start;
+        size_t len;
+        long offset;
+    };
+
+    // an index of a buffer with no write in flight, waiting for one to complete if need be
+    int Acquire()
+    {
+        for (;;)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mLock);
+                for (size_t i=0; i<mBuffers.size(); ++i)
+                {
+                    if (mBuffers[i].pending == 0)
+                    {
+                        mBuffers[i].used = 0;
+                        mBuffers[i].submitted = 0;
+                        return (int)i;
+                    }
+                }
+            }
+
+            if (mRing >= 0)
+            {
+                Reap(true);
+            }
+            else
+            {
+                std::unique_lock<std::mutex> lock(mLock);
+                mFreed.wait(lock, [&]() {
+                    for (size_t i=0; i<mBuffers.size(); ++i) if (mBuffers[i].pending == 0) return true;
+                    return false;
+                });
+            }
+        }
+    }
+
+    // the unsubmitted part of the current buffer goes out at the next offset
+    void Submit()
+    {
+        buffer & b = mBuffers[mCurrent];
+        if (b.used == b.submitted) return;
+
+        op o = { mCurrent, b.submitted, b.used - b.submitted, mOffset };
+        mOffset += o.len;
+        b.submitted = b.used;
+        if (b.used == mBufferSize) mCurrent = -1;
+
+        if (mRing >= 0)
+        {
+            b.pending++;
+            Reap(false);
+            while (mFreeOps.empty()) Reap(true);
+
+            int id = mFreeOps.back();
+            mFreeOps.pop_back();
+            mOps[id] = o;
+            PushWrite(id);
+            mInflight++;
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            b.pending++;
+            mQueue.push_back(o);
+            mCond.notify_one();
+        }
+    }
+
+    // writes the rest of what the kernel took only part of, or failed to write
+    void Complete(const op & o, long written)
+    {
+        buffer & b = mBuffers[o.buffer];
+        if (written < 0)
+        {
+            mError = (int)-written;
+            written = 0;
+        }
+
+        while ((size_t)written < o.len)
+        {
+            ssize_t n = pwrite(mFd, b.data + o.start + written, o.len - written, o.offset + written);
+            if (n <= 0)
+            {
+                if (n < 0 && errno == EINTR) continue;
+                mError = n < 0 ? errno : EIO;
+                break;
+            }
+            written += n;
+        }
+
+        std::lock_guard<std::mutex> lock(mLock);
+        b.pending--;
+    }
+
+#ifdef IMSLOG_HAVE_URING
+    // io_uring without liburing: the rings are mapped from the ring fd and driven with
+    // acquire/release accesses to their head and tail
+    struct ring
+    {
+        void * map;
+        size_t mapSize;
+        unsigned * head;
+        unsigned * tail;
+        unsigned * mask;
+        unsigned * array;       // sq only
+        io_uring_cqe * cqes;    // cq only
+    };
+
+    void SetupRing(int depth)
+    {
+        io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        int fd = (int)syscall(__NR_io_uring_setup, (unsigned)depth, &p);
+        if (fd < 0) return;
+
+        mSq.mapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        mCq.mapSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) mSq.mapSize = mCq.mapSize = std::max(mSq.mapSize, mCq.mapSize);
+
+        mSq.map = mmap(NULL, mSq.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        mCq.map = single ? mSq.map : mmap(NULL, mCq.mapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        mSqesSize = p.sq_entries * sizeof(io_uring_sqe);
+        mSqes = (io_uring_sqe *)mmap(NULL, mSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (mSq.map == MAP_FAILED || mCq.map == MAP_FAILED || mSqes == MAP_FAILED)
+        {
+            if (mSq.map != MAP_FAILED) munmap(mSq.map, mSq.mapSize);
+            if (!single && mCq.map != MAP_FAILED) munmap(mCq.map, mCq.mapSize);
+            if (mSqes != MAP_FAILED) munmap(mSqes, mSqesSize);
+            ::close(fd);
+            return;
+        }
+
+        char * sq = (char *)mSq.map;
+        mSq.head = (unsigned *)(sq + p.sq_off.head);
+        mSq.tail = (unsigned *)(sq + p.sq_off.tail);
+        mSq.mask = (unsigned *)(sq + p.sq_off.ring_mask);
+        mSq.array = (unsigned *)(sq + p.sq_off.array);
+
+        char * cq = (char *)mCq.map;
+        mCq.head = (unsigned *)(cq + p.cq_off.head);
+        mCq.tail = (unsigned *)(cq + p.cq_off.tail);
+        mCq.mask = (unsigned *)(cq + p.cq_off.ring_mask);
+        mCq.cqes = (io_uring_cqe *)(cq + p.cq_off.cqes);
+        mRing = fd;
+
+        // no more writes in flight than the submission queue holds
+        mOps.resize(p.sq_entries);
+        for (int i = (int)p.sq_entries - 1; i >= 0; --i) mFreeOps.push_back(i);
+
+        // registered buffers spare the kernel mapping them on every write; RLIMIT_MEMLOCK
+        // may not allow it, plain writes from the same buffers work too
+        std::vector<iovec> iov(mBuffers.size());
+        for (size_t i=0; i<mBuffers.size(); ++i)
+        {
+            iov[i].iov_base = mBuffers[i].data;
+            iov[i].iov_len = mBufferSize;
+        }
+        mFixed = syscall(__NR_io_uring_register, mRing, IORING_REGISTER_BUFFERS, &iov[0], (unsigned)iov.size()) == 0;
+    }
+
+    void PushWrite(int id)
+    {
+        const op & o = mOps[id];
+        unsigned tail = *mSq.tail;
+        unsigned slot = tail & *mSq.mask;
+
+        io_uring_sqe * sqe = &mSqes[slot];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = mFixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = mFd;
+        sqe->addr = (unsigned long)(mBuffers[o.buffer].data + o.start);
+        sqe->len = (unsigned)o.len;
+        sqe->off = (unsigned long long)o.offset;
+        sqe->buf_index = mFixed ? (unsigned short)o.buffer : 0;
+        sqe->user_data = (unsigned long long)id;
+
+        mSq.array[slot] = slot;
+        __atomic_store_n(mSq.tail, tail + 1, __ATOMIC_RELEASE);
+
+        while (syscall(__NR_io_uring_enter, mRing, 1, 0, 0, NULL, 0) < 0 && errno == EINTR);
+    }
+
+    // collects completed writes; wait blocks for at least one
+    void Reap(bool wait)
+    {
+        if (wait && mInflight)
+        {
+            while (syscall(__NR_io_uring_enter, mRing, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno == EINTR);
+        }
+
+        unsigned head = *mCq.head;
+        unsigned tail = __atomic_load_n(mCq.tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            io_uring_cqe & cqe = mCq.cqes[head & *mCq.mask];
+            int id = (int)cqe.user_data;
+            Complete(mOps[id], cqe.res);
+            mFreeOps.push_back(id);
+            mInflight--;
+        }
+        __atomic_store_n(mCq.head, head, __ATOMIC_RELEASE);
+    }
+#else
+    // built without io_uring: mRing stays -1 and none of these is reached
+    void SetupRing(int) {}
+    void PushWrite(int) {}
+    void Reap(bool) {}
+#endif
+
+    // fallback: the queued writes are consecutive in the file, one pwritev() takes many
+    void WorkerProc()
+    {
+        std::unique_lock<std::mutex> lock(mLock);
+        for (;;)
+        {
+            mCond.wait(lock, [&]() { return mStopping || !mQueue.empty(); });
+            if (mQueue.empty()) break;
+
+            std::vector<op> batch;
+            while (!mQueue.empty() && batch.size() < IOV_MAX)
+            {
+                batch.push_back(mQueue.front());
+                mQueue.pop_front();
+            }
+            mInflight = (int)batch.size();
+            lock.unlock();
+
+            std::vector<iovec> iov(batch.size());
+            for (size_t i=0; i<batch.size(); ++i)
+            {
+                iov[i].iov_base = mBuffers[batch[i].buffer].data + batch[i].start;
+                iov[i].iov_len = batch[i].len;
+            }
+
+            ssize_t n;
+            while ((n = pwritev(mFd, &iov[0], (int)iov.size(), batch[0].offset)) < 0 && errno == EINTR);
+
+            // what pwritev() did not take is finished write by write
+            long done = n < 0 ? -errno : (long)n;
+            for (size_t i=0; i<batch.size(); ++i)
+            {
+                long written = done < 0 ? (i == 0 ? done : 0) : std::min(done, (long)batch[i].len);
+                if (done > 0) done -= written;
+                Complete(batch[i], written);
+            }
+
+            lock.lock();
+            mInflight = 0;
+            mFreed.notify_all();
+        }
+    }
+
+    int mFd;
+    size_t mBufferSize;
+    std::vector<buffer> mBuffers;
+    int mCurrent;           // buffer being filled, -1 for none
+    long mOffset;           // where the next submitted write goes
+    std::atomic<int> mError;
+
+    int mRing;
+    bool mFixed;
+    int mInflight;
+#ifdef IMSLOG_HAVE_URING
+    ring mSq;
+    ring mCq;
+    io_uring_sqe * mSqes;
+    size_t mSqesSize;
+#endif
+    std::vector<op> mOps;   // by user_data of the submission
+    std::vector<int> mFreeOps;
+
+    // pwritev() worker
+    std::deque<op> mQueue;
+    bool mStopping;
+    std::thread mWorker;
+    std::mutex mLock;
+    std::condition_variable mCond;
+    std::condition_variable mFreed;
+};
+
+#endif//IMSLOG_URING_WRITER_H_INCLUDED__
@@ -108,6 +108,15 @@ public:
 		}
 	}
 
+	// true when from_utf8() and to_utf8() only copy
+	bool is_utf8() const
+	{
+		charset_map & chmap = s_charset_map();
+		charset_map::iterator it = chmap.find(m_mbs_charset);
+
+		return it != chmap.end() && it->second == chmap["UTF-8"];
+	}
+
 private:
 	static charset_map & s_charset_map()
 	{
@@ -102,9 +102,16 @@ public:
 		return std::string(gb.front(), gb.filled());
 	}
 
+	// built once: it is looked up for every string packed or popped
 	static charset_map & init_charset_map()
 	{
-		static charset_map ch_map;
+		static charset_map ch_map = make_charset_map();
+		return ch_map;
+	}
+
+	static charset_map make_charset_map()
+	{
+		charset_map ch_map;
 		ch_map["UTF8"]		= "UTF-8";
 		ch_map["UTF-8"]		= "UTF-8";
 		ch_map["ANSI"]		= "ASCII";
@@ -29,9 +29,16 @@ public:
 		return unicode_to_mbcs(to_charset, unicode.c_str(), (int)unicode.length());
 	}
 
+	// built once: it is looked up for every string packed or popped
 	static charset_map & init_charset_map()
 	{
-		static charset_map ch_map;
+		static charset_map ch_map = make_charset_map();
+		return ch_map;
+	}
+
+	static charset_map make_charset_map()
+	{
+		charset_map ch_map;
 		ch_map["UTF8"]		= CP_UTF8;
 		ch_map["UTF-8"]		= CP_UTF8;
 		ch_map["ANSI"]		= CP_ACP;